@@ -0,0 +1,79 @@
+#ifndef ALIASTABLE_H
+#define ALIASTABLE_H
+
+#include <vector>
+#include <algorithm>
+
+/*
+ * AliasTable
+ * Samples an index in proportion to a list of weights in constant time
+ * Built with Vose's method, every bin holds its own probability and one alias
+ */
+class AliasTable {
+public:
+    AliasTable() {};
+    AliasTable(const std::vector<float> &weights) { Build(weights); };
+
+    void Build(const std::vector<float> &weights) {
+        const int n = weights.size();
+        m_bins.assign(n, Bin());
+        m_pmf.assign(n, 0.0f);
+
+        float total = 0.0f;
+        for (float w : weights) total += std::max(w, 0.0f);
+        if (n == 0 || total <= 0.0f) { m_bins.clear(); m_pmf.clear(); return; }
+
+        // Scale so the average bin holds exactly one
+        std::vector<float> scaled(n);
+        std::vector<int> small, large;
+        for (int i = 0; i < n; ++i) {
+            m_pmf[i] = std::max(weights[i], 0.0f) / total;
+            scaled[i] = m_pmf[i] * n;
+            if (scaled[i] < 1.0f) small.push_back(i);
+            else large.push_back(i);
+        }
+
+        // Fill each small bin up to one with probability from a large one
+        while (!small.empty() && !large.empty()) {
+            int s = small.back(); small.pop_back();
+            int l = large.back(); large.pop_back();
+            m_bins[s].Chance = scaled[s];
+            m_bins[s].Alias = l;
+            scaled[l] = (scaled[l] + scaled[s]) - 1.0f;
+            if (scaled[l] < 1.0f) small.push_back(l);
+            else large.push_back(l);
+        }
+
+        // Whatever is left over is full up to rounding
+        for (int i : large) m_bins[i].Chance = 1.0f;
+        for (int i : small) m_bins[i].Chance = 1.0f;
+    }
+
+    bool Empty() const { return m_bins.empty(); };
+    int Size() const { return m_bins.size(); };
+    float Pmf(int i) const { return m_pmf[i]; };
+
+    /*
+     * Pick an index with a single uniform u in [0,1)
+     * The integer part of u*n chooses the bin and the fraction decides between it and its alias
+     */
+    int Sample(float u, float &pmf) const {
+        const int n = m_bins.size();
+        float scaled = u * n;
+        int bin = std::min(int(scaled), n - 1);
+        float rest = scaled - bin;
+        int i = rest < m_bins[bin].Chance ? bin : m_bins[bin].Alias;
+        pmf = m_pmf[i];
+        return i;
+    }
+
+private:
+    struct Bin {
+        float Chance = 1.0f;
+        int Alias = 0;
+    };
+    std::vector<Bin> m_bins;
+    std::vector<float> m_pmf;
+};
+
+#endif
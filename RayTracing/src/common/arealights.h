@@ -0,0 +1,124 @@
+#ifndef AREALIGHTS_H
+#define AREALIGHTS_H
+
+#include <vector>
+
+#include "aliastable.h"
+#include "lightbvh.h"
+#include "montecarlo.h"
+#include "colour3.h"
+#include "objectlist.h"
+#include "vec3.h"
+
+/*
+ * A point chosen on an area light
+ * Pdf is per unit area and already includes the chance of choosing the light
+ */
+struct LightPoint {
+    Point3 Point;
+    Dir3 Normal;
+    Colour3 Emission;
+    float Pdf = 0.0f;
+    int ObjectId = -1;
+};
+
+/*
+ * AreaLights
+ * Every emissive object of the scene, sampled through an alias table weighted by power times area
+ */
+class AreaLights {
+public:
+    AreaLights() {};
+
+    void Build(const ObjectList &objl);
+    bool Empty() const { return m_table.Empty(); };
+    bool Sample(float uLight, float u, float v, LightPoint &lp) const;
+    float Pdf(int objectId) const;
+
+    // Access to single lights, for light selection done elsewhere
+    int Count() const { return m_objects.size(); };
+    int LightOf(int objectId) const;
+    float Area(int light) const { return m_area[light]; };
+    int Object(int light) const { return m_objects[light]; };
+    void SamplePoint(int light, float u, float v, LightPoint &lp) const;
+    LightBounds Bounds(int light) const;
+
+private:
+    std::vector<int> m_objects;
+    std::vector<int> m_lightOf;
+    std::vector<float> m_area;
+    AliasTable m_table;
+    const ObjectList *m_objl = nullptr;
+};
+
+void AreaLights::Build(const ObjectList &objl) {
+    m_objl = &objl;
+    m_objects.clear();
+    m_area.clear();
+    m_lightOf.assign(objl.objects.size(), -1);
+
+    std::vector<float> power;
+    for (unsigned int i = 0; i < objl.objects.size(); ++i) {
+        const auto &object = objl.objects[i];
+        float area = object->Area();
+        float emitted = Luminance(objl.MaterialOf(i).Emission);
+        if (area <= 0.0f || emitted <= 0.0f) continue;
+
+        m_lightOf[i] = m_objects.size();
+        m_objects.push_back(i);
+        m_area.push_back(area);
+        power.push_back(emitted * area);
+    }
+    m_table.Build(power);
+}
+
+bool AreaLights::Sample(float uLight, float u, float v, LightPoint &lp) const {
+    if (Empty()) return false;
+
+    float pmf;
+    int light = m_table.Sample(uLight, pmf);
+    SamplePoint(light, u, v, lp);
+    lp.Pdf = pmf / m_area[light];
+    return true;
+}
+
+/*
+ * Point on one light, with Pdf per unit area given that light was chosen
+ */
+void AreaLights::SamplePoint(int light, float u, float v, LightPoint &lp) const {
+    const auto &object = m_objl->objects[m_objects[light]];
+    lp.Point = object->SamplePoint(u, v, lp.Normal);
+    lp.Emission = m_objl->MaterialOf(m_objects[light]).Emission;
+    lp.Pdf = 1.0f / m_area[light];
+    lp.ObjectId = m_objects[light];
+}
+
+int AreaLights::LightOf(int objectId) const {
+    if (objectId < 0 || objectId >= int(m_lightOf.size())) return -1;
+    return m_lightOf[objectId];
+}
+
+/*
+ * Bounds of a light for the light BVH, with the power of a two sided Lambertian emitter
+ */
+LightBounds AreaLights::Bounds(int light) const {
+    const auto &object = m_objl->objects[m_objects[light]];
+    LightBounds b;
+    object->Bounds(b.Lo, b.Hi);
+    b.CosNormals = object->NormalCone(b.Axis);
+    b.CosEmission = 0.0f;
+    b.TwoSided = true;
+    b.Power = 2.0f * MonteCarlo::PI * Luminance(m_objl->MaterialOf(m_objects[light]).Emission) * m_area[light];
+    return b;
+}
+
+/*
+ * Area density with which Sample picks a point on the given object, zero if it is not a light
+ */
+float AreaLights::Pdf(int objectId) const {
+    int light = LightOf(objectId);
+    if (light < 0) return 0.0f;
+    return m_table.Pmf(light) / m_area[light];
+}
+
+#endif
@@ -0,0 +1,139 @@
+#ifndef ASYNCWRITER_H
+#define ASYNCWRITER_H
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <memory>
+#include <thread>
+
+/*
+ * AsyncWriter
+ * A thread of its own running output jobs, converting and writing finished parts of an image,
+ * while render threads carry on. Jobs run one at a time in the order they were posted, so they
+ * can share state without locks of their own
+ * Jobs pass through a bounded lock-free ring (Vyukov's MPMC queue): each slot's sequence number
+ * says whether it is free to fill or ready to take, and producers and the writer claim slots by
+ * advancing a counter with compare and swap. A full ring makes Post wait, which bounds the
+ * memory queued jobs hold. An empty one makes the writer back off to short sleeps, so it does
+ * not take a core from rendering
+ */
+class AsyncWriter {
+public:
+    using Job = std::function<void()>;
+
+    // Room for capacity jobs, rounded up to a power of two
+    explicit AsyncWriter(size_t capacity = 64);
+    AsyncWriter(const AsyncWriter &) = delete;
+    AsyncWriter &operator=(const AsyncWriter &) = delete;
+    ~AsyncWriter() { Finish(); };
+
+    // Hand a job to the writer, from any thread
+    void Post(Job job);
+
+    // Run every job posted so far and stop the thread
+    void Finish();
+
+private:
+    struct Slot {
+        std::atomic<size_t> Sequence;
+        Job Value;
+    };
+
+    bool TryPush(Job &job);
+    bool TryPop(Job &job);
+    void Run();
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask = 0;
+    alignas(64) std::atomic<size_t> m_tail{0}; // Next slot to fill
+    alignas(64) std::atomic<size_t> m_head{0}; // Next slot to take
+    std::atomic<bool> m_finishing{false};
+    std::thread m_thread;
+};
+
+AsyncWriter::AsyncWriter(size_t capacity) {
+    size_t size = 2;
+    while (size < capacity) size *= 2;
+    m_slots.reset(new Slot[size]);
+    for (size_t i = 0; i < size; ++i)
+        m_slots[i].Sequence.store(i, std::memory_order_relaxed);
+    m_mask = size - 1;
+    m_thread = std::thread(&AsyncWriter::Run, this);
+}
+
+void AsyncWriter::Post(Job job) {
+    while (!TryPush(job))
+        std::this_thread::yield();
+}
+
+void AsyncWriter::Finish() {
+    if (!m_thread.joinable()) return;
+    m_finishing = true;
+    m_thread.join();
+}
+
+/*
+ * A slot is free to fill at position pos when its sequence is pos, and ready to take once the
+ * producer sets it to pos + 1. Taking it sets it to pos + size, free for the next lap
+ */
+bool AsyncWriter::TryPush(Job &job) {
+    size_t pos = m_tail.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot &slot = m_slots[pos & m_mask];
+        size_t seq = slot.Sequence.load(std::memory_order_acquire);
+        if (seq == pos) {
+            if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                slot.Value = std::move(job);
+                slot.Sequence.store(pos + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (seq < pos) {
+            return false; // Full
+        } else {
+            pos = m_tail.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+bool AsyncWriter::TryPop(Job &job) {
+    size_t pos = m_head.load(std::memory_order_relaxed);
+    for (;;) {
+        Slot &slot = m_slots[pos & m_mask];
+        size_t seq = slot.Sequence.load(std::memory_order_acquire);
+        if (seq == pos + 1) {
+            if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                job = std::move(slot.Value);
+                slot.Value = nullptr;
+                slot.Sequence.store(pos + m_mask + 1, std::memory_order_release);
+                return true;
+            }
+        } else if (seq < pos + 1) {
+            return false; // Empty
+        } else {
+            pos = m_head.load(std::memory_order_relaxed);
+        }
+    }
+}
+
+void AsyncWriter::Run() {
+    Job job;
+    int idle = 0;
+    for (;;) {
+        // Posts made before Finish are in the ring once it is seen, so empty after that means done
+        bool finishing = m_finishing;
+        if (TryPop(job)) {
+            job();
+            job = nullptr;
+            idle = 0;
+        } else if (finishing) {
+            return;
+        } else if (++idle < 64) {
+            std::this_thread::yield();
+        } else {
+            std::this_thread::sleep_for(std::chrono::microseconds(200));
+        }
+    }
+}
+
+#endif
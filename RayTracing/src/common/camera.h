@@ -19,7 +19,59 @@ public:
         m_lc = m_p - m_h/2 - m_v/2 - Point3(0, 0, m_p.z() - focalLength);
     }
 
-    Ray CameraRay(const float u, const float v) { return Ray(m_p, m_lc + u*m_h + v*m_v - m_p); };
+    /*
+     * Camera at position looking towards lookAt, with up giving which way is the top of the image
+     * The viewport is viewPortHeight tall and aspectRatio times as wide, distance in front
+     */
+    Camera(Point3 position, Point3 lookAt, Dir3 up, float viewPortHeight, float distance, float aspectRatio) {
+        Dir3 forward = Unit(lookAt - position);
+        Dir3 right = Unit(Cross(up, forward));
+        m_p = position;
+        m_h = (aspectRatio * viewPortHeight) * right;
+        m_v = viewPortHeight * Cross(forward, right);
+        m_lc = m_p + distance * forward - m_h/2 - m_v/2;
+    }
+
+    Ray CameraRay(const float u, const float v) const { return Ray(m_p, m_lc + u*m_h + v*m_v - m_p); };
+    Point3 Position() const { return m_p; };
+
+    /*
+     * The (u, v) of the camera ray through p, and the solid angle per unit of u and v around it
+     * Returns false when p is not in front of the camera
+     */
+    bool Project(const Point3 &p, float &u, float &v, float &solidAngle) const {
+        Dir3 n = Cross(m_h, m_v);
+        Dir3 d = p - m_p;
+        float along = Dot(d, n);
+        if (along <= 0.0f) return false;
+
+        // Where the ray meets the image plane, from the lower left corner
+        Dir3 toPlane = (Dot(m_lc - m_p, n) / along) * d;
+        Dir3 q = m_p + toPlane - m_lc;
+        u = Dot(q, m_h) / m_h.LengthSquared();
+        v = Dot(q, m_v) / m_v.LengthSquared();
+
+        // Plane area per unit of u and v, foreshortened and over the squared distance
+        float distance2 = toPlane.LengthSquared();
+        float cosPlane = along / (d.Length() * n.Length());
+        solidAngle = n.Length() * cosPlane / distance2;
+        return true;
+    }
+
+    /*
+     * Film coordinates of p before the perspective divide, u = x / w and v = y / w, with w the
+     * distance of p in front of the camera. All three are linear in p, so triangles can be
+     * clipped against the camera before dividing
+     */
+    void Homogeneous(const Point3 &p, float &x, float &y, float &w) const {
+        Dir3 axis = Unit(Cross(m_h, m_v));
+        Dir3 d = p - m_p;
+        Dir3 corner = m_p - m_lc;
+        float focal = -Dot(corner, axis);
+        w = Dot(d, axis);
+        x = (Dot(corner, m_h) * w + focal * Dot(d, m_h)) / m_h.LengthSquared();
+        y = (Dot(corner, m_v) * w + focal * Dot(d, m_v)) / m_v.LengthSquared();
+    }
 private:
     Point3 m_p;
     Dir3 m_h;
@@ -0,0 +1,134 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "pixelstats.h"
+
+/*
+ * Checkpoint
+ * The running statistics of every pixel kept in a file mapped into memory, so a render that is
+ * stopped can carry on from its last save. The file holds a header naming the image, sampler and
+ * scene it belongs to, then two slots of PixelStats used in turn. A save fills the slot not in use and
+ * flushes it before the header points to it, so a save cut short leaves the previous one intact
+ */
+class Checkpoint {
+public:
+    struct Header {
+        char Magic[8];
+        uint32_t Width;
+        uint32_t Height;
+        uint32_t Samples;
+        uint32_t Sampler;
+        uint32_t Scene;
+        int32_t Slot; // Slot of the last complete save, -1 for none
+    };
+
+    Checkpoint() {};
+    Checkpoint(const Checkpoint &) = delete;
+    Checkpoint &operator=(const Checkpoint &) = delete;
+    ~Checkpoint() { Close(); };
+
+    /*
+     * Map the file at path for an image, creating or resizing it as needed
+     * A file that held a save of the same image, sampler and scene keeps it, any other save is
+     * dropped. Returns false on failure
+     */
+    bool Open(const std::string &path, uint32_t width, uint32_t height, uint32_t samples, uint32_t sampler, uint32_t scene);
+    void Close();
+
+    // Whether there is a save to carry on from
+    bool HasSave() const { return m_header && m_header->Slot >= 0; };
+
+    void Load(std::vector<PixelStats> &stats) const;
+    void Save(const std::vector<PixelStats> &stats);
+
+private:
+    static_assert(std::is_trivially_copyable<PixelStats>::value, "PixelStats is saved byte for byte");
+
+    PixelStats *SlotData(int slot) const {
+        return reinterpret_cast<PixelStats*>(static_cast<char*>(m_map) + sizeof(Header)) + size_t(slot) * m_pixels;
+    }
+
+    int m_fd = -1;
+    void *m_map = nullptr;
+    size_t m_bytes = 0;
+    size_t m_pixels = 0;
+    Header *m_header = nullptr;
+};
+
+bool Checkpoint::Open(const std::string &path, uint32_t width, uint32_t height, uint32_t samples, uint32_t sampler, uint32_t scene) {
+    Close();
+    const char magic[8] = {'R', 'T', 'C', 'K', 'P', 'T', '2', '\0'};
+    m_pixels = size_t(width) * height;
+    m_bytes = sizeof(Header) + 2 * m_pixels * sizeof(PixelStats);
+
+    m_fd = open(path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (m_fd < 0) return false;
+
+    // Only a file of the right size can hold a save of this image
+    off_t size = lseek(m_fd, 0, SEEK_END);
+    bool fits = size == off_t(m_bytes);
+    if (!fits && ftruncate(m_fd, m_bytes) != 0) {
+        Close();
+        return false;
+    }
+    m_map = mmap(nullptr, m_bytes, PROT_READ | PROT_WRITE, MAP_SHARED, m_fd, 0);
+    if (m_map == MAP_FAILED) {
+        m_map = nullptr;
+        Close();
+        return false;
+    }
+
+    m_header = static_cast<Header*>(m_map);
+    bool same = fits && std::memcmp(m_header->Magic, magic, sizeof(magic)) == 0 &&
+                m_header->Width == width && m_header->Height == height &&
+                m_header->Samples == samples && m_header->Sampler == sampler &&
+                m_header->Scene == scene && m_header->Slot >= -1 && m_header->Slot <= 1;
+    if (!same) {
+        std::memcpy(m_header->Magic, magic, sizeof(magic));
+        m_header->Width = width;
+        m_header->Height = height;
+        m_header->Samples = samples;
+        m_header->Sampler = sampler;
+        m_header->Scene = scene;
+        m_header->Slot = -1;
+        msync(m_map, sizeof(Header), MS_SYNC);
+    }
+    return true;
+}
+
+void Checkpoint::Close() {
+    if (m_map)
+        munmap(m_map, m_bytes);
+    if (m_fd >= 0)
+        close(m_fd);
+    m_map = nullptr;
+    m_header = nullptr;
+    m_fd = -1;
+}
+
+void Checkpoint::Load(std::vector<PixelStats> &stats) const {
+    if (!HasSave()) return;
+    stats.resize(m_pixels);
+    std::memcpy(static_cast<void*>(stats.data()), SlotData(m_header->Slot), m_pixels * sizeof(PixelStats));
+}
+
+void Checkpoint::Save(const std::vector<PixelStats> &stats) {
+    if (!m_header || stats.size() != m_pixels) return;
+    int slot = m_header->Slot == 0 ? 1 : 0;
+    std::memcpy(static_cast<void*>(SlotData(slot)), stats.data(), m_pixels * sizeof(PixelStats));
+    msync(m_map, m_bytes, MS_SYNC);
+    m_header->Slot = slot;
+    msync(m_map, sizeof(Header), MS_SYNC);
+}
+
+#endif
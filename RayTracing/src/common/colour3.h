@@ -1,54 +1,48 @@
 #ifndef COLOUR3_H
 #define COLOUR3_H
 
+#include <algorithm>
 #include <iostream>
 
 /*
  * Colour Class
- * Stores r, g, b values of a colour
+ * Stores r, g, b values of a colour. Sums of light are kept as they are, above 1 included, and
+ * only clamped once they are written out
  */
 class Colour3 {
 public:
     Colour3() : m_r(0.0f), m_g(0.0f), m_b(0.0f) {};
-    Colour3(float r, float g, float b) {
-        m_r = Clamp(r);
-        m_g = Clamp(g);
-        m_b = Clamp(b);
-    }
+    Colour3(float r, float g, float b) : m_r(r), m_g(g), m_b(b) {};
 
     float r() const { return m_r; };
     float g() const { return m_g; };
     float b() const { return m_b; };
 
-    // Write the translated [0,255] value of each color component.
-    void WriteColor(std::ostream &out) {
-        out << static_cast<int>(255.999 * m_r) << ' '
-            << static_cast<int>(255.999 * m_g) << ' '
-            << static_cast<int>(255.999 * m_b) << '\n';
+    // Write the translated [0,255] value of each color component, clamped to [0,1] first
+    void WriteColor(std::ostream &out) const {
+        out << static_cast<int>(255.999f * Clamp(m_r)) << ' '
+            << static_cast<int>(255.999f * Clamp(m_g)) << ' '
+            << static_cast<int>(255.999f * Clamp(m_b)) << '\n';
     };
 
     // Summation to itself
     Colour3& operator+=(const Colour3 &c) {
-        m_r = Clamp(m_r + c.r());
-        m_g = Clamp(m_g + c.g());
-        m_b = Clamp(m_b + c.b());
+        m_r += c.r();
+        m_g += c.g();
+        m_b += c.b();
         return *this;
     };
 
     // Multiplication to itself
     Colour3& operator*=(const float t) {
-        m_r = Clamp(m_r * t);
-        m_g = Clamp(m_g * t);
-        m_b = Clamp(m_b * t);
+        m_r *= t;
+        m_g *= t;
+        m_b *= t;
         return *this;
     };
 
 private:
-    float Clamp(float c) {
-        if (c < 0.0f) c = 0.0f;
-        if (c > 1.0f) c = 1.0f;
-        return c;
-    };
+    static float Clamp(float c) { return std::min(std::max(c, 0.0f), 1.0f); };
     float m_r;
     float m_g;
     float m_b;
@@ -71,6 +65,15 @@ inline Colour3 operator-(const Colour3 &u, const Colour3 &v) {
     return Colour3(u.r() - v.r(), u.g() - v.g(), u.b() - v.b());
 };
 
+inline bool operator==(const Colour3 &u, const Colour3 &v) {
+    return u.r() == v.r() && u.g() == v.g() && u.b() == v.b();
+};
+
+// Perceived brightness with Rec. 709 weights
+inline float Luminance(const Colour3 &c) {
+    return 0.2126f * c.r() + 0.7152f * c.g() + 0.0722f * c.b();
+};
+
 // inline Colour3 operator*(const Colour3 &u, const Colour3 &v) {
 //     return Colour3((u.r() * v.r()) / 255.0f, (u.g() * v.g()) / 255.0f, (u.b() * v.b()) / 255.0f);
 // };
@@ -0,0 +1,180 @@
+#ifndef DENOISER_H
+#define DENOISER_H
+
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "colour3.h"
+#include "parallel.h"
+#include "surfel.h"
+
+/*
+ * PixelFeatures
+ * Running average of what the camera rays of one pixel hit first: albedo, normal and depth
+ * Pixels whose rays hit nothing keep zeros
+ */
+class PixelFeatures {
+public:
+    void Add(const Surfel &s, float depth) {
+        m_albedo[0] += s.Diffuse.r();
+        m_albedo[1] += s.Diffuse.g();
+        m_albedo[2] += s.Diffuse.b();
+        Dir3 n = Unit(s.Normal);
+        m_normal[0] += n.x();
+        m_normal[1] += n.y();
+        m_normal[2] += n.z();
+        m_depth += depth;
+        ++m_n;
+    }
+
+    // Camera rays that missed still count towards the average
+    void AddMiss() { ++m_n; };
+
+    float Albedo(int c) const { return m_n ? m_albedo[c] / m_n : 0.0f; };
+    float Normal(int c) const { return m_n ? m_normal[c] / m_n : 0.0f; };
+    float Depth() const { return m_n ? m_depth / m_n : 0.0f; };
+
+private:
+    float m_albedo[3] = {0.0f, 0.0f, 0.0f};
+    float m_normal[3] = {0.0f, 0.0f, 0.0f};
+    float m_depth = 0.0f;
+    int m_n = 0;
+};
+
+/*
+ * Denoiser
+ * Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010, "Edge-Avoiding A-Trous Wavelet
+ * Transform for fast Global Illumination Filtering")
+ * Each iteration applies the 5x5 B3 spline kernel with holes of 2^i pixels. Taps are weighted
+ * down where colour, albedo, normal or depth differ from the centre pixel, so the blur stays
+ * inside surfaces. Buffers are kept as separate planes and every tap runs over a whole row, so
+ * the inner loop is branch free and vectorises; rows are split between threads
+ */
+class Denoiser {
+public:
+    int Iterations = 5;
+    float ColourSigma = 0.6f;
+    float AlbedoSigma = 0.1f;
+    float NormalSigma = 0.1f;
+    float DepthSigma = 0.1f;
+    int Threads = 0;
+
+    std::vector<Colour3> Run(int width, int height, const std::vector<Colour3> &colour,
+                             const std::vector<PixelFeatures> &features) const;
+
+private:
+    // exp(x) for x <= 0 as (1 + x/256)^256, cheap and vectorisable
+    static float FastExp(float x) {
+        x = 1.0f + std::max(x, -80.0f) * (1.0f / 256.0f);
+        x *= x; x *= x; x *= x; x *= x;
+        x *= x; x *= x; x *= x; x *= x;
+        return x;
+    }
+};
+
+std::vector<Colour3> Denoiser::Run(int width, int height, const std::vector<Colour3> &colour,
+                                   const std::vector<PixelFeatures> &features) const {
+    const int pixels = width * height;
+
+    // Split into planes
+    std::vector<float> in[3], out[3], albedo[3], normal[3], depth(pixels);
+    for (int c = 0; c < 3; ++c) {
+        in[c].resize(pixels);
+        out[c].resize(pixels);
+        albedo[c].resize(pixels);
+        normal[c].resize(pixels);
+    }
+    for (int p = 0; p < pixels; ++p) {
+        in[0][p] = colour[p].r();
+        in[1][p] = colour[p].g();
+        in[2][p] = colour[p].b();
+        for (int c = 0; c < 3; ++c) {
+            albedo[c][p] = features[p].Albedo(c);
+            normal[c][p] = features[p].Normal(c);
+        }
+        depth[p] = features[p].Depth();
+    }
+
+    // Depth differences are relative to the scene's depth range
+    float maxDepth = *std::max_element(depth.begin(), depth.end());
+    const float depthScale = 1.0f / (DepthSigma * std::max(maxDepth, 1e-6f));
+    const float albedoScale = 1.0f / (AlbedoSigma * AlbedoSigma);
+    const float normalScale = 1.0f / NormalSigma;
+    const float kernel[5] = {1.0f/16.0f, 1.0f/4.0f, 3.0f/8.0f, 1.0f/4.0f, 1.0f/16.0f};
+
+    for (int iteration = 0; iteration < Iterations; ++iteration) {
+        const int step = 1 << iteration;
+
+        // Finer detail survives longer as the kernel widens
+        const float sigma = ColourSigma * std::pow(2.0f, -float(iteration));
+        const float colourScale = 1.0f / (sigma * sigma);
+
+        Parallel::For(height, 8, Threads, [&](int rowBegin, int rowEnd) {
+            std::vector<float> sum[3], weights(width);
+            for (int c = 0; c < 3; ++c) sum[c].resize(width);
+
+            for (int y = rowBegin; y < rowEnd; ++y) {
+                std::fill(weights.begin(), weights.end(), 0.0f);
+                for (int c = 0; c < 3; ++c) std::fill(sum[c].begin(), sum[c].end(), 0.0f);
+                const int row = y * width;
+
+                for (int ky = -2; ky <= 2; ++ky) {
+                    const int ty = y + ky * step;
+                    if (ty < 0 || ty >= height) continue;
+
+                    for (int kx = -2; kx <= 2; ++kx) {
+                        const int dx = kx * step;
+                        const int x0 = std::max(0, -dx);
+                        const int x1 = std::min(width, width - dx);
+                        const float h = kernel[ky + 2] * kernel[kx + 2];
+                        const int tap = ty * width + dx;
+
+                        const float *r = in[0].data(), *g = in[1].data(), *b = in[2].data();
+                        const float *ar = albedo[0].data(), *ag = albedo[1].data(), *ab = albedo[2].data();
+                        const float *nx = normal[0].data(), *ny = normal[1].data(), *nz = normal[2].data();
+                        const float *z = depth.data();
+                        float *sr = sum[0].data(), *sg = sum[1].data(), *sb = sum[2].data(), *w = weights.data();
+
+                        for (int x = x0; x < x1; ++x) {
+                            const int p = row + x;
+                            const int q = tap + x;
+                            float dr = r[q] - r[p], dg = g[q] - g[p], db = b[q] - b[p];
+                            float dar = ar[q] - ar[p], dag = ag[q] - ag[p], dab = ab[q] - ab[p];
+                            float cosN = nx[q] * nx[p] + ny[q] * ny[p] + nz[q] * nz[p];
+                            float dz = std::abs(z[q] - z[p]);
+
+                            float e = (dr*dr + dg*dg + db*db) * colourScale
+                                    + (dar*dar + dag*dag + dab*dab) * albedoScale
+                                    + std::max(0.0f, 1.0f - cosN) * normalScale
+                                    + dz * depthScale;
+                            float wq = h * FastExp(-e);
+
+                            sr[x] += wq * r[q];
+                            sg[x] += wq * g[q];
+                            sb[x] += wq * b[q];
+                            w[x] += wq;
+                        }
+                    }
+                }
+
+                // The centre tap always has weight, so the sum is never zero
+                for (int x = 0; x < width; ++x) {
+                    float inv = 1.0f / weights[x];
+                    out[0][row + x] = sum[0][x] * inv;
+                    out[1][row + x] = sum[1][x] * inv;
+                    out[2][row + x] = sum[2][x] * inv;
+                }
+            }
+        });
+
+        for (int c = 0; c < 3; ++c) std::swap(in[c], out[c]);
+    }
+
+    std::vector<Colour3> result(pixels);
+    for (int p = 0; p < pixels; ++p)
+        result[p] = Colour3(in[0][p], in[1][p], in[2][p]);
+    return result;
+}
+
+#endif
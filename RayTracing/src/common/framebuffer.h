@@ -0,0 +1,46 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include <vector>
+
+#include "colour3.h"
+
+/*
+ * Framebuffer
+ * The linear radiance of every pixel as floats, r, g and b in turn along the rows from the top.
+ * Nothing is clamped here, so the image keeps light above 1 until it is converted for output
+ */
+class Framebuffer {
+public:
+    Framebuffer() {};
+    Framebuffer(int width, int height) : m_width(width), m_height(height), m_data(3 * size_t(width) * height, 0.0f) {};
+    Framebuffer(int width, int height, const std::vector<Colour3> &pixels) : Framebuffer(width, height) {
+        for (size_t p = 0; p < pixels.size() && p < Pixels(); ++p)
+            Set(p, pixels[p]);
+    }
+
+    int Width() const { return m_width; };
+    int Height() const { return m_height; };
+    size_t Pixels() const { return size_t(m_width) * m_height; };
+
+    void Set(size_t pixel, const Colour3 &c) {
+        float *p = &m_data[3 * pixel];
+        p[0] = c.r();
+        p[1] = c.g();
+        p[2] = c.b();
+    }
+    Colour3 Get(size_t pixel) const {
+        const float *p = &m_data[3 * pixel];
+        return Colour3(p[0], p[1], p[2]);
+    }
+
+    // All 3 * Pixels() values in one run
+    const float *Data() const { return m_data.data(); };
+
+private:
+    int m_width = 0;
+    int m_height = 0;
+    std::vector<float> m_data;
+};
+
+#endif
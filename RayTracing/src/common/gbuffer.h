@@ -0,0 +1,53 @@
+#ifndef GBUFFER_H
+#define GBUFFER_H
+
+#include <vector>
+
+#include "sampler.h"
+#include "vec3.h"
+
+/*
+ * FirstHit
+ * Where one camera sample first landed: the film coordinates of its ray, and the distance along
+ * it, the normal and the object of the hit. ObjectId is -1 for samples that leave the scene
+ */
+struct FirstHit {
+    float U = 0.0f;
+    float V = 0.0f;
+    float At = 0.0f;
+    Dir3 Normal;
+    int ObjectId = -1;
+};
+
+/*
+ * GBuffer
+ * The first hit of every sample of every pixel, pixel by pixel, for shading again without casting
+ * camera rays. Hits hold no material, which is read from the object when shading, so they stay
+ * valid while only lights and materials change
+ */
+class GBuffer {
+public:
+    void Reset(int pixels, int samples, const Sampler *sampler) {
+        m_hits.assign(size_t(pixels) * samples, FirstHit());
+        m_pixels = pixels;
+        m_samples = samples;
+        m_sampler = sampler;
+    }
+
+    // Whether the buffer was filled for this image and these sample positions
+    bool Matches(int pixels, int samples, const Sampler *sampler) const {
+        return !m_hits.empty() && pixels == m_pixels && samples == m_samples && sampler == m_sampler;
+    }
+
+    FirstHit &Hit(int pixel, int sample) { return m_hits[size_t(pixel) * m_samples + sample]; };
+    const FirstHit &Hit(int pixel, int sample) const { return m_hits[size_t(pixel) * m_samples + sample]; };
+    size_t Bytes() const { return m_hits.size() * sizeof(FirstHit); };
+
+private:
+    std::vector<FirstHit> m_hits;
+    int m_pixels = 0;
+    int m_samples = 0;
+    const Sampler *m_sampler = nullptr;
+};
+
+#endif
@@ -0,0 +1,192 @@
+#ifndef IMAGEFILE_H
+#define IMAGEFILE_H
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "framebuffer.h"
+#include "parallel.h"
+#include "tonemapper.h"
+
+// P3 is the plain text PPM, P6 the binary one and Qoi the lossless "Quite OK Image" format, all
+// 8 bit through a ToneMapper. Pfm keeps the float radiance as it is
+enum class ImageFormat { P3, P6, Pfm, Qoi };
+
+namespace ImageFile {
+
+// Rows of each band of a QOI image compressed on its own
+const int QoiBandRows = 32;
+
+inline bool EndsWith(const std::string &path, const std::string &ext) {
+    return path.size() >= ext.size() && path.compare(path.size() - ext.size(), ext.size(), ext) == 0;
+}
+
+// Pfm for paths ending in .pfm, Qoi for .qoi, P6 otherwise
+inline ImageFormat FromPath(const std::string &path) {
+    if (EndsWith(path, ".pfm")) return ImageFormat::Pfm;
+    if (EndsWith(path, ".qoi")) return ImageFormat::Qoi;
+    return ImageFormat::P6;
+}
+
+/*
+ * QOI chunks for a run of RGB pixels, following the pixel prev
+ * The stream carries on from prev as the decoder will have it, so bands encoded apart join into
+ * one valid stream: the colour index starts empty, which only loses matches, a run still open at
+ * the end is closed, and differences are taken from the last pixel of the band before
+ */
+inline std::string QoiChunks(const uint8_t *rgb, size_t pixels, const uint8_t prev[3]) {
+    std::string out;
+    out.reserve(pixels * 4);
+    uint8_t index[64][3] = {};
+    bool seen[64] = {};
+    uint8_t p[3] = {prev[0], prev[1], prev[2]};
+    int run = 0;
+    for (size_t i = 0; i < pixels; ++i) {
+        const uint8_t *c = rgb + 3 * i;
+        if (c[0] == p[0] && c[1] == p[1] && c[2] == p[2]) {
+            if (++run == 62) {
+                out += char(0xc0 | (run - 1));
+                run = 0;
+            }
+            continue;
+        }
+        if (run > 0) {
+            out += char(0xc0 | (run - 1));
+            run = 0;
+        }
+
+        // Alpha is always 255, which the hash counts as 255 * 11
+        const int slot = (c[0] * 3 + c[1] * 5 + c[2] * 7 + 255 * 11) % 64;
+        if (seen[slot] && std::memcmp(index[slot], c, 3) == 0) {
+            out += char(slot);
+        } else {
+            seen[slot] = true;
+            std::memcpy(index[slot], c, 3);
+            const int dr = int8_t(c[0] - p[0]), dg = int8_t(c[1] - p[1]), db = int8_t(c[2] - p[2]);
+            const int drg = dr - dg, dbg = db - dg;
+            if (dr >= -2 && dr <= 1 && dg >= -2 && dg <= 1 && db >= -2 && db <= 1) {
+                out += char(0x40 | (dr + 2) << 4 | (dg + 2) << 2 | (db + 2));
+            } else if (dg >= -32 && dg <= 31 && drg >= -8 && drg <= 7 && dbg >= -8 && dbg <= 7) {
+                out += char(0x80 | (dg + 32));
+                out += char((drg + 8) << 4 | (dbg + 8));
+            } else {
+                out += char(0xfe);
+                out.append(reinterpret_cast<const char*>(c), 3);
+            }
+        }
+        std::memcpy(p, c, 3);
+    }
+    if (run > 0)
+        out += char(0xc0 | (run - 1));
+    return out;
+}
+
+// Start of a P3 or P6 file, for pixels to follow from AppendPixels
+inline std::string Header(ImageFormat format, int width, int height) {
+    return std::string(format == ImageFormat::P3 ? "P3\n" : "P6\n") + std::to_string(width) + ' ' +
+           std::to_string(height) + "\n255\n";
+}
+
+/*
+ * Count values, whole pixels, as a P3 or P6 file holds them, through display. P6 converts them
+ * in one pass of the ToneMapper straight into the file. P3 prints each byte from a table of the
+ * 256 numbers
+ */
+inline void AppendPixels(std::string &file, const float *values, size_t count, ImageFormat format, const ToneMapper &display) {
+    const size_t start = file.size();
+    if (format == ImageFormat::P6) {
+        file.resize(start + count);
+        display.Convert(values, count, reinterpret_cast<uint8_t*>(&file[start]));
+        return;
+    }
+
+    static const std::vector<std::string> numbers = []() {
+        std::vector<std::string> n;
+        for (int i = 0; i < 256; ++i)
+            n.push_back(std::to_string(i));
+        return n;
+    }();
+    std::vector<uint8_t> bytes(count);
+    display.Convert(values, count, bytes.data());
+    file.reserve(start + 4 * count);
+    for (size_t k = 0; k < count; ++k) {
+        file += numbers[bytes[k]];
+        file += k % 3 == 2 ? '\n' : ' ';
+    }
+}
+
+/*
+ * The whole file in memory. The 8 bit formats convert the image in one pass of the ToneMapper.
+ * QOI bands of QoiBandRows rows are compressed on threads workers and joined in order
+ */
+inline std::string Encode(const Framebuffer &frame, ImageFormat format, const ToneMapper &display, int threads = 0) {
+    const size_t count = 3 * frame.Pixels();
+    if (format == ImageFormat::Qoi) {
+        std::vector<uint8_t> bytes(count);
+        display.Convert(frame.Data(), count, bytes.data());
+
+        const size_t row = 3 * size_t(frame.Width());
+        const int bands = (frame.Height() + QoiBandRows - 1) / QoiBandRows;
+        std::vector<std::string> chunks(bands);
+        Parallel::For(bands, 1, threads, [&](int begin, int end) {
+            for (int b = begin; b < end; ++b) {
+                const int y0 = b * QoiBandRows, y1 = std::min(frame.Height(), y0 + QoiBandRows);
+                const uint8_t black[3] = {0, 0, 0};
+                const uint8_t *first = bytes.data() + y0 * row;
+                chunks[b] = QoiChunks(first, (y1 - y0) * size_t(frame.Width()), b == 0 ? black : first - 3);
+            }
+        });
+
+        // Header of magic, big endian size, 3 channels and sRGB, then the chunks and end marker
+        std::string file = "qoif";
+        for (uint32_t v : {uint32_t(frame.Width()), uint32_t(frame.Height())})
+            for (int shift = 24; shift >= 0; shift -= 8)
+                file += char(v >> shift);
+        file += char(3);
+        file += char(0);
+        size_t total = file.size() + 8;
+        for (const auto &c : chunks)
+            total += c.size();
+        file.reserve(total);
+        for (const auto &c : chunks)
+            file += c;
+        file.append(7, char(0));
+        file += char(1);
+        return file;
+    }
+
+    if (format == ImageFormat::Pfm) {
+        std::string file = "PF\n" + std::to_string(frame.Width()) + ' ' + std::to_string(frame.Height()) + '\n';
+        // A negative scale marks little endian floats. Rows go from the bottom up
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        file += "1.0\n";
+#else
+        file += "-1.0\n";
+#endif
+        const size_t header = file.size(), row = 3 * size_t(frame.Width()) * sizeof(float);
+        file.resize(header + count * sizeof(float));
+        for (int y = 0; y < frame.Height(); ++y)
+            std::memcpy(&file[header + size_t(frame.Height() - 1 - y) * row], frame.Data() + 3 * size_t(frame.Width()) * y, row);
+        return file;
+    }
+
+    std::string file = Header(format, frame.Width(), frame.Height());
+    AppendPixels(file, frame.Data(), count, format, display);
+    return file;
+}
+
+// Hand the file over in one write, to stdout when the path is empty. Returns false on failure
+inline bool Write(const std::string &path, const std::string &file) {
+    std::FILE *out = path.empty() ? stdout : std::fopen(path.c_str(), "wb");
+    if (!out) return false;
+    bool ok = std::fwrite(file.data(), 1, file.size(), out) == file.size();
+    ok = (path.empty() ? std::fflush(out) : std::fclose(out)) == 0 && ok;
+    return ok;
+}
+
+}
+
+#endif
@@ -0,0 +1,251 @@
+#ifndef IRRADIANCECACHE_H
+#define IRRADIANCECACHE_H
+
+#include <atomic>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+
+#include "colour3.h"
+#include "montecarlo.h"
+#include "vec3.h"
+
+/*
+ * IrradianceRecord
+ * Indirect irradiance arriving at a point, per colour channel, with its rotational and
+ * translational gradients (Ward and Heckbert 1992) and the radius it is valid over
+ */
+struct IrradianceRecord {
+    Point3 Point;
+    Dir3 Normal;
+    float Irradiance[3];
+    Dir3 Rotation[3];
+    Dir3 Translation[3];
+    float Radius;
+    IrradianceRecord *Next = nullptr;
+};
+
+/*
+ * IrradianceCache
+ * Sparse irradiance records in an octree, interpolated with Ward's error weights
+ * A record is kept in the smallest node at least as large as the area it can be used in, so a
+ * lookup only visits the nodes on the way to the point and their neighbours. Records and nodes
+ * are only ever added, by compare and swap, so lookups need no locks while other threads insert
+ */
+class IrradianceCache {
+public:
+    // Largest error a record may be used with, and the bounds on a record's radius
+    float Error = 0.3f;
+    float MinSpacing = 0.02f;
+    float MaxSpacing = 0.5f;
+
+    IrradianceCache() {};
+    ~IrradianceCache() { Clear(); };
+    IrradianceCache(const IrradianceCache &) = delete;
+    IrradianceCache& operator=(const IrradianceCache &) = delete;
+
+    void Reset(const Point3 &lo, const Point3 &hi);
+    void Clear();
+    bool Lookup(const Point3 &p, const Dir3 &n, float irradiance[3]) const;
+    void Insert(const IrradianceRecord &record);
+    int Size() const { return m_size.load(std::memory_order_relaxed); };
+
+    IrradianceRecord Record(const Point3 &p, const Dir3 &n, int thetaStrata, int phiStrata,
+                            const std::vector<Colour3> &radiance, const std::vector<float> &distance) const;
+
+private:
+    struct Node {
+        Point3 Centre;
+        float Half;
+        std::atomic<Node*> Children[8];
+        std::atomic<IrradianceRecord*> Records{nullptr};
+        Node(const Point3 &centre, float half) : Centre(centre), Half(half) {
+            for (auto &c : Children) c.store(nullptr, std::memory_order_relaxed);
+        }
+    };
+
+    static void Delete(Node *node);
+    static int ChildOf(const Node *node, const Point3 &p);
+    static Point3 ChildCentre(const Node *node, int child);
+    void Gather(const Node *node, const Point3 &p, const Dir3 &n, float sum[3], float &weights) const;
+
+    Node *m_root = nullptr;
+    std::atomic<int> m_size{0};
+};
+
+void IrradianceCache::Reset(const Point3 &lo, const Point3 &hi) {
+    Clear();
+    Dir3 extent = hi - lo;
+    float half = 0.5f * std::max({extent.x(), extent.y(), extent.z(), 1e-3f});
+    // A little margin so points on the scene bounds are strictly inside
+    m_root = new Node(0.5f * (lo + hi), 1.01f * half);
+}
+
+void IrradianceCache::Clear() {
+    Delete(m_root);
+    m_root = nullptr;
+    m_size = 0;
+}
+
+void IrradianceCache::Delete(Node *node) {
+    if (!node) return;
+    for (auto &c : node->Children)
+        Delete(c.load());
+    IrradianceRecord *r = node->Records.load();
+    while (r) {
+        IrradianceRecord *next = r->Next;
+        delete r;
+        r = next;
+    }
+    delete node;
+}
+
+int IrradianceCache::ChildOf(const Node *node, const Point3 &p) {
+    return (p.x() > node->Centre.x() ? 1 : 0) | (p.y() > node->Centre.y() ? 2 : 0) | (p.z() > node->Centre.z() ? 4 : 0);
+}
+
+Point3 IrradianceCache::ChildCentre(const Node *node, int child) {
+    float q = 0.5f * node->Half;
+    return node->Centre + Dir3(child & 1 ? q : -q, child & 2 ? q : -q, child & 4 ? q : -q);
+}
+
+/*
+ * Add a record to the node whose half size just covers the distance the record can be used over
+ */
+void IrradianceCache::Insert(const IrradianceRecord &record) {
+    if (!m_root) return;
+    const float reach = Error * record.Radius;
+
+    Node *node = m_root;
+    while (0.5f * node->Half >= reach) {
+        int child = ChildOf(node, record.Point);
+        Node *next = node->Children[child].load(std::memory_order_acquire);
+        if (!next) {
+            Node *fresh = new Node(ChildCentre(node, child), 0.5f * node->Half);
+            if (node->Children[child].compare_exchange_strong(next, fresh, std::memory_order_acq_rel))
+                next = fresh;
+            else
+                delete fresh; // Another thread made it first, next now holds theirs
+        }
+        node = next;
+    }
+
+    IrradianceRecord *r = new IrradianceRecord(record);
+    r->Next = node->Records.load(std::memory_order_relaxed);
+    while (!node->Records.compare_exchange_weak(r->Next, r, std::memory_order_release, std::memory_order_relaxed));
+    m_size.fetch_add(1, std::memory_order_relaxed);
+}
+
+/*
+ * Interpolate irradiance at p from every record whose error there is below Error
+ * Returns false, leaving irradiance untouched, if no record is close enough
+ */
+bool IrradianceCache::Lookup(const Point3 &p, const Dir3 &n, float irradiance[3]) const {
+    if (!m_root) return false;
+    float sum[3] = {0.0f, 0.0f, 0.0f};
+    float weights = 0.0f;
+    Gather(m_root, p, n, sum, weights);
+    if (weights <= 0.0f) return false;
+    for (int c = 0; c < 3; ++c)
+        irradiance[c] = std::max(sum[c] / weights, 0.0f);
+    return true;
+}
+
+void IrradianceCache::Gather(const Node *node, const Point3 &p, const Dir3 &n, float sum[3], float &weights) const {
+    for (const IrradianceRecord *r = node->Records.load(std::memory_order_acquire); r; r = r->Next) {
+        // Points in front of the record see something the record did not
+        Dir3 d = p - r->Point;
+        if (Dot(d, n + r->Normal) < -0.1f * r->Radius) continue;
+
+        float error = d.Length() / r->Radius + std::sqrt(std::max(0.0f, 1.0f - Dot(n, r->Normal)));
+        if (error >= Error) continue;
+
+        // Fades to zero at the edge of the record's reach so records blend in without seams
+        float w = 1.0f / std::max(error, 1e-4f) - 1.0f / Error;
+        Dir3 turn = Cross(r->Normal, n);
+        for (int c = 0; c < 3; ++c)
+            sum[c] += w * (r->Irradiance[c] + Dot(turn, r->Rotation[c]) + Dot(d, r->Translation[c]));
+        weights += w;
+    }
+
+    // A child's records are used no further than its half size beyond it
+    for (int child = 0; child < 8; ++child) {
+        const Node *c = node->Children[child].load(std::memory_order_acquire);
+        if (!c) continue;
+        Dir3 d = p - c->Centre;
+        float reach = 2.0f * c->Half;
+        if (std::abs(d.x()) <= reach && std::abs(d.y()) <= reach && std::abs(d.z()) <= reach)
+            Gather(c, p, n, sum, weights);
+    }
+}
+
+/*
+ * Build a record from incoming radiance over a stratified cosine weighted hemisphere
+ * Sample j*phiStrata + k came from polar stratum j and azimuthal stratum k, and travelled
+ * distance before hitting something. The gradients follow Ward and Heckbert 1992, in the form
+ * given by Krivanek et al. 2008. The radius is the harmonic mean distance, shrunk where the
+ * translational gradient says irradiance changes quickly, then clamped to the spacing bounds
+ */
+IrradianceRecord IrradianceCache::Record(const Point3 &p, const Dir3 &n, int thetaStrata, int phiStrata,
+                                         const std::vector<Colour3> &radiance, const std::vector<float> &distance) const {
+    const int M = thetaStrata, N = phiStrata;
+    const float PI = MonteCarlo::PI;
+    Dir3 t, b;
+    MonteCarlo::OrthonormalBasis(n, t, b);
+    auto L = [&](int j, int k, int c) {
+        const Colour3 &l = radiance[j * N + k];
+        return c == 0 ? l.r() : (c == 1 ? l.g() : l.b());
+    };
+    auto r = [&](int j, int k) { return distance[j * N + k]; };
+    auto planar = [&](float phi) { return std::cos(phi) * t + std::sin(phi) * b; };
+
+    IrradianceRecord record;
+    record.Point = p;
+    record.Normal = n;
+
+    float inverseDistances = 0.0f;
+    for (float d : distance) inverseDistances += 1.0f / d;
+
+    for (int c = 0; c < 3; ++c) {
+        float e = 0.0f;
+        Dir3 rotation, translation;
+        for (int k = 0; k < N; ++k) {
+            float phiMinus = 2.0f * PI * k / N;
+            float phiCentre = 2.0f * PI * (k + 0.5f) / N;
+            Dir3 u = planar(phiCentre);
+            Dir3 v = planar(phiCentre + 0.5f * PI);
+            Dir3 vMinus = planar(phiMinus + 0.5f * PI);
+
+            float polar = 0.0f, azimuthal = 0.0f, rotational = 0.0f;
+            for (int j = 0; j < M; ++j) {
+                float cosMinus = std::sqrt(1.0f - float(j) / M);
+                float cosPlus = std::sqrt(1.0f - float(j + 1) / M);
+                float sinMinus = std::sqrt(float(j) / M);
+                float cosCentre = std::sqrt(1.0f - (j + 0.5f) / M);
+                float sinCentre = std::sqrt((j + 0.5f) / M);
+
+                e += L(j, k, c);
+                rotational -= sinCentre / cosCentre * L(j, k, c);
+                if (j > 0)
+                    polar += sinMinus * cosMinus * cosMinus / std::min(r(j, k), r(j-1, k)) * (L(j, k, c) - L(j-1, k, c));
+                int kPrev = (k + N - 1) % N;
+                azimuthal += (cosMinus - cosPlus) / (sinCentre * std::min(r(j, k), r(j, kPrev))) * (L(j, k, c) - L(j, kPrev, c));
+            }
+            translation = translation + (2.0f * PI / N) * polar * u + azimuthal * vMinus;
+            rotation = rotation + rotational * v;
+        }
+        record.Irradiance[c] = PI * e / (M * N);
+        record.Rotation[c] = (PI / (M * N)) * rotation;
+        record.Translation[c] = translation;
+    }
+
+    float radius = inverseDistances > 0.0f ? (M * N) / inverseDistances : MaxSpacing;
+    for (int c = 0; c < 3; ++c) {
+        float g = record.Translation[c].Length();
+        if (g > 0.0f) radius = std::min(radius, record.Irradiance[c] / g);
+    }
+    record.Radius = std::min(std::max(radius, MinSpacing), MaxSpacing);
+    return record;
+}
+
+#endif
@@ -22,6 +22,14 @@ private:
     Colour3 m_c;
 };
 
+// Whether two lights would light the scene the same
+inline bool operator==(const Light &a, const Light &b) {
+    Point3 p = a.Position(), q = b.Position();
+    return p.x() == q.x() && p.y() == q.y() && p.z() == q.z() && a.Colour() == b.Colour() &&
+           a.Ambient == b.Ambient && a.Diffuse == b.Diffuse && a.Specular == b.Specular &&
+           a.IsAtInfinity == b.IsAtInfinity && a.Power == b.Power;
+};
+
 /*
     Description of light ambient, diffuse and specular
     
@@ -0,0 +1,268 @@
+#ifndef LIGHTBVH_H
+#define LIGHTBVH_H
+
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "montecarlo.h"
+#include "vec3.h"
+
+/*
+ * LightBounds
+ * What a light BVH node knows about the lights below it: a box around them, their total power,
+ * a cone around their emitting normals and how far past that cone they still emit
+ * Follows Conty Estevez and Kulla 2018, "Importance Sampling of Many Lights on the GPU"
+ */
+struct LightBounds {
+    Point3 Lo;
+    Point3 Hi;
+    float Power = 0.0f;
+    Dir3 Axis = Dir3(0.0f, 0.0f, 1.0f);
+    float CosNormals = -1.0f;  // cos of the normal cone's half angle, -1 covers every direction
+    float CosEmission = 0.0f;  // cos of how far around the normals light leaves, 0 for a hemisphere
+    bool TwoSided = false;
+
+    float Importance(const Point3 &p, const Dir3 &n) const;
+};
+
+namespace LightCone {
+
+// cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+inline float CosSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    if (cosA > cosB) return 1.0f;
+    return cosA * cosB + sinA * sinB;
+}
+
+inline float SinSubClamped(float sinA, float cosA, float sinB, float cosB) {
+    if (cosA > cosB) return 0.0f;
+    return sinA * cosB - cosA * sinB;
+}
+
+inline float SinFromCos(float c) { return std::sqrt(std::max(0.0f, 1.0f - c * c)); }
+
+// Rotate v about the unit axis k by angle theta (Rodrigues)
+inline Dir3 Rotate(const Dir3 &v, const Dir3 &k, float theta) {
+    float c = std::cos(theta);
+    float s = std::sin(theta);
+    return c * v + s * Cross(k, v) + (Dot(k, v) * (1.0f - c)) * k;
+}
+
+/*
+ * Smallest cone holding both cones, as in pbrt's DirectionCone::Union
+ */
+inline void Union(const Dir3 &a, float cosA, const Dir3 &b, float cosB, Dir3 &axis, float &cosOut) {
+    float thetaA = std::acos(std::clamp(cosA, -1.0f, 1.0f));
+    float thetaB = std::acos(std::clamp(cosB, -1.0f, 1.0f));
+    float thetaD = std::acos(std::clamp(Dot(a, b), -1.0f, 1.0f));
+
+    if (std::min(thetaD + thetaB, MonteCarlo::PI) <= thetaA) { axis = a; cosOut = cosA; return; }
+    if (std::min(thetaD + thetaA, MonteCarlo::PI) <= thetaB) { axis = b; cosOut = cosB; return; }
+
+    float thetaO = (thetaA + thetaD + thetaB) / 2.0f;
+    Dir3 k = Cross(a, b);
+    if (thetaO >= MonteCarlo::PI || k.LengthSquared() == 0.0f) { axis = a; cosOut = -1.0f; return; }
+
+    axis = Unit(Rotate(a, Unit(k), thetaO - thetaA));
+    cosOut = std::cos(thetaO);
+}
+
+}
+
+inline LightBounds Union(const LightBounds &a, const LightBounds &b) {
+    if (a.Power <= 0.0f) return b;
+    if (b.Power <= 0.0f) return a;
+
+    LightBounds u;
+    u.Lo = Point3(std::min(a.Lo.x(), b.Lo.x()), std::min(a.Lo.y(), b.Lo.y()), std::min(a.Lo.z(), b.Lo.z()));
+    u.Hi = Point3(std::max(a.Hi.x(), b.Hi.x()), std::max(a.Hi.y(), b.Hi.y()), std::max(a.Hi.z(), b.Hi.z()));
+    u.Power = a.Power + b.Power;
+    LightCone::Union(a.Axis, a.CosNormals, b.Axis, b.CosNormals, u.Axis, u.CosNormals);
+    u.CosEmission = std::min(a.CosEmission, b.CosEmission);
+    u.TwoSided = a.TwoSided || b.TwoSided;
+    return u;
+}
+
+/*
+ * Rough contribution of the lights in these bounds to point p with normal n
+ * Every angle is widened by the angle the box subtends from p, so the estimate never rules out a
+ * light that could contribute
+ */
+float LightBounds::Importance(const Point3 &p, const Dir3 &n) const {
+    using namespace LightCone;
+    Point3 centre = 0.5f * (Lo + Hi);
+    float radius2 = (Hi - centre).LengthSquared();
+    float distance2 = std::max((p - centre).LengthSquared(), std::sqrt(radius2));
+
+    // Angle between the cone axis and the direction from the box to p
+    Dir3 wi = (p - centre).LengthSquared() > 0.0f ? Unit(p - centre) : n;
+    float cosW = Dot(Axis, wi);
+    if (TwoSided) cosW = std::abs(cosW);
+    float sinW = SinFromCos(cosW);
+
+    // Angle the box subtends from p
+    float cosB = -1.0f;
+    if ((p - centre).LengthSquared() > radius2)
+        cosB = std::sqrt(std::max(0.0f, 1.0f - radius2 / (p - centre).LengthSquared()));
+    float sinB = SinFromCos(cosB);
+
+    // Angle from p to the nearest emitting normal, less the box's angular size
+    float sinO = SinFromCos(CosNormals);
+    float cosX = CosSubClamped(sinW, cosW, sinO, CosNormals);
+    float sinX = SinSubClamped(sinW, cosW, sinO, CosNormals);
+    float cosP = CosSubClamped(sinX, cosX, sinB, cosB);
+    if (cosP <= CosEmission) return 0.0f;
+
+    float importance = Power * cosP / distance2;
+
+    // Receiver cosine, widened the same way
+    float cosI = std::abs(Dot(wi, n));
+    float sinI = SinFromCos(cosI);
+    importance *= CosSubClamped(sinI, cosI, sinB, cosB);
+    return std::max(importance, 0.0f);
+}
+
+/*
+ * LightBVH
+ * Binary tree over every light's bounds. Sampling walks from the root choosing a child in
+ * proportion to its importance for the shading point, so the cost grows with the depth of the
+ * tree rather than with the number of lights
+ */
+class LightBVH {
+public:
+    LightBVH() {};
+
+    void Build(const std::vector<LightBounds> &lights);
+    bool Empty() const { return m_nodes.empty(); };
+
+    // Pick a light for point p with normal n, returns -1 if no light can reach p
+    int Sample(const Point3 &p, const Dir3 &n, float u, float &pmf) const;
+
+    // Chance that Sample would pick the given light for p and n
+    float Pmf(const Point3 &p, const Dir3 &n, int light) const;
+
+private:
+    struct Node {
+        LightBounds Bounds;
+        int Child = -1;  // Second child, the first follows this node. Light index for leaves
+        bool Leaf = false;
+    };
+
+    int BuildRange(std::vector<int> &order, int begin, int end, uint64_t trail, int depth);
+
+private:
+    std::vector<Node> m_nodes;
+    std::vector<LightBounds> m_lights;
+    std::vector<uint64_t> m_trail;  // Left or right at each level on the way to each light
+};
+
+void LightBVH::Build(const std::vector<LightBounds> &lights) {
+    m_nodes.clear();
+    m_lights = lights;
+    m_trail.assign(lights.size(), 0);
+
+    std::vector<int> order;
+    for (unsigned int i = 0; i < lights.size(); ++i)
+        if (lights[i].Power > 0.0f) order.push_back(i);
+    if (order.empty()) return;
+
+    BuildRange(order, 0, order.size(), 0, 0);
+}
+
+/*
+ * Split at the median centroid along the widest axis of the centroids
+ */
+int LightBVH::BuildRange(std::vector<int> &order, int begin, int end, uint64_t trail, int depth) {
+    int index = m_nodes.size();
+    m_nodes.emplace_back();
+
+    if (end - begin == 1) {
+        m_nodes[index].Bounds = m_lights[order[begin]];
+        m_nodes[index].Child = order[begin];
+        m_nodes[index].Leaf = true;
+        m_trail[order[begin]] = trail;
+        return index;
+    }
+
+    Point3 lo = 0.5f * (m_lights[order[begin]].Lo + m_lights[order[begin]].Hi);
+    Point3 hi = lo;
+    for (int i = begin; i < end; ++i) {
+        Point3 c = 0.5f * (m_lights[order[i]].Lo + m_lights[order[i]].Hi);
+        lo = Point3(std::min(lo.x(), c.x()), std::min(lo.y(), c.y()), std::min(lo.z(), c.z()));
+        hi = Point3(std::max(hi.x(), c.x()), std::max(hi.y(), c.y()), std::max(hi.z(), c.z()));
+    }
+    Dir3 extent = hi - lo;
+    int axis = 0;
+    if (extent.y() > extent.x()) axis = 1;
+    if (extent.z() > (axis == 0 ? extent.x() : extent.y())) axis = 2;
+
+    auto centre = [&](int light) {
+        Point3 c = m_lights[light].Lo + m_lights[light].Hi;
+        return axis == 0 ? c.x() : (axis == 1 ? c.y() : c.z());
+    };
+    int mid = (begin + end) / 2;
+    std::nth_element(order.begin() + begin, order.begin() + mid, order.begin() + end,
+                     [&](int a, int b) { return centre(a) < centre(b); });
+
+    // Trails only hold 64 levels, which a median split never reaches
+    BuildRange(order, begin, mid, trail, depth + 1);
+    int second = BuildRange(order, mid, end, trail | (uint64_t(1) << depth), depth + 1);
+
+    m_nodes[index].Child = second;
+    m_nodes[index].Bounds = Union(m_nodes[index + 1].Bounds, m_nodes[second].Bounds);
+    return index;
+}
+
+int LightBVH::Sample(const Point3 &p, const Dir3 &n, float u, float &pmf) const {
+    pmf = 0.0f;
+    if (Empty()) return -1;
+
+    int node = 0;
+    float chance = 1.0f;
+    while (!m_nodes[node].Leaf) {
+        int first = node + 1;
+        int second = m_nodes[node].Child;
+        float a = m_nodes[first].Bounds.Importance(p, n);
+        float b = m_nodes[second].Bounds.Importance(p, n);
+        if (a <= 0.0f && b <= 0.0f) return -1;
+
+        // Choose a child and stretch u back over [0,1) for the next level
+        float pFirst = a / (a + b);
+        if (u < pFirst) {
+            node = first;
+            u = std::min(u / pFirst, 0.99999994f);
+            chance *= pFirst;
+        } else {
+            node = second;
+            u = std::min((u - pFirst) / (1.0f - pFirst), 0.99999994f);
+            chance *= 1.0f - pFirst;
+        }
+    }
+
+    pmf = chance;
+    return m_nodes[node].Child;
+}
+
+float LightBVH::Pmf(const Point3 &p, const Dir3 &n, int light) const {
+    if (Empty() || light < 0 || light >= int(m_lights.size()) || m_lights[light].Power <= 0.0f) return 0.0f;
+
+    int node = 0;
+    float chance = 1.0f;
+    uint64_t trail = m_trail[light];
+    while (!m_nodes[node].Leaf) {
+        int first = node + 1;
+        int second = m_nodes[node].Child;
+        float a = m_nodes[first].Bounds.Importance(p, n);
+        float b = m_nodes[second].Bounds.Importance(p, n);
+        if (a <= 0.0f && b <= 0.0f) return 0.0f;
+
+        bool right = trail & 1;
+        chance *= (right ? b : a) / (a + b);
+        node = right ? second : first;
+        trail >>= 1;
+    }
+    return chance;
+}
+
+#endif
@@ -0,0 +1,121 @@
+#ifndef MATERIAL_H
+#define MATERIAL_H
+
+#include <cstdint>
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "colour3.h"
+
+/*
+ * Material
+ * How a surface reflects and emits light. Objects refer to one by its id in a MaterialTable,
+ * and a hit copies the fields into its Surfel once it is known to be the closest
+ * Aligned to cache lines so shading one material reads no bytes of its neighbours
+ */
+struct alignas(64) Material {
+    Colour3 Emission = Colour3(0.0f, 0.0f, 0.0f);
+    float AmbientAlbedo = 0.7f;
+    float LambertAlbedo = 0.7;
+    float GlossyAlbedo = 0.7;
+    float Exponent = 20.0f;
+    float Impulse = 0.1;
+    float ImpulseAlbedo = 1.0f;
+
+    Colour3 Ambient = Colour3(0.2f, 0.2f, 0.2f);
+    Colour3 Diffuse = Colour3(0.7f, 0.7f, 0.7f);
+    Colour3 Specular = Colour3(1.0f, 1.0f, 1.0f);
+};
+
+/*
+ * MaterialTable
+ * Every material of a scene, shared by all its objects, which hold only a 16 bit id into it
+ * Id 0 is the default material, which objects start with
+ */
+class MaterialTable {
+public:
+    MaterialTable() : m_materials(1), m_names(1) {};
+
+    // Id of a new material, or 0 when the table already holds as many as ids can name
+    uint16_t Add(const Material &m, const std::string &name = "");
+    // Id of the first material added with that name, 0 when there is none
+    uint16_t Find(const std::string &name) const;
+
+    Material &operator[](uint16_t id) { return m_materials[id]; };
+    const Material &operator[](uint16_t id) const { return m_materials[id]; };
+    size_t Size() const { return m_materials.size(); };
+
+private:
+    std::vector<Material> m_materials;
+    std::vector<std::string> m_names;
+};
+
+uint16_t MaterialTable::Add(const Material &m, const std::string &name) {
+    if (m_materials.size() > UINT16_MAX) {
+        std::cerr << "Too many materials, using the default for " << name << std::endl;
+        return 0;
+    }
+    m_materials.push_back(m);
+    m_names.push_back(name);
+    return uint16_t(m_materials.size() - 1);
+}
+
+uint16_t MaterialTable::Find(const std::string &name) const {
+    for (size_t id = 1; id < m_names.size(); ++id)
+        if (m_names[id] == name) return uint16_t(id);
+    return 0;
+}
+
+/*
+ * Set the field of m an mtl style line names by key, from the values that follow in in
+ * Besides Ka, Kd, Ks, Ke and Ns, "impulse" gives Impulse and ImpulseAlbedo and "albedo" gives
+ * AmbientAlbedo, LambertAlbedo and GlossyAlbedo. Returns false for other keys or missing values
+ */
+inline bool ReadMaterialValue(const std::string &key, std::istream &in, Material &m) {
+    float v[3];
+    if (key == "Ka" || key == "Kd" || key == "Ks" || key == "Ke") {
+        if (!(in >> v[0] >> v[1] >> v[2])) return false;
+        Colour3 &to = key == "Ka" ? m.Ambient : key == "Kd" ? m.Diffuse : key == "Ks" ? m.Specular : m.Emission;
+        to = Colour3(v[0], v[1], v[2]);
+    } else if (key == "Ns") {
+        if (!(in >> v[0])) return false;
+        m.Exponent = v[0];
+    } else if (key == "impulse") {
+        if (!(in >> v[0] >> v[1])) return false;
+        m.Impulse = v[0];
+        m.ImpulseAlbedo = v[1];
+    } else if (key == "albedo") {
+        if (!(in >> v[0] >> v[1] >> v[2])) return false;
+        m.AmbientAlbedo = v[0];
+        m.LambertAlbedo = v[1];
+        m.GlossyAlbedo = v[2];
+    } else {
+        return false;
+    }
+    return true;
+}
+
+/*
+    Lighting and material explanation
+
+    Ambient:
+        The ambient material vector defines what color the surface reflects under ambient lighting.
+        This is usually the same as the surface's color
+
+    Diffuse:
+        The diffuse material vector defines the color of the surface under diffuse lighting.
+        The diffuse color is (just like ambient lighting) set to the desired surface's color.
+
+    Specular:
+        The specular material vector sets the color of the specular highlight on the surface
+        (or possibly even reflect a surface-specific color).
+
+    Exponent:
+        The exponent impacts the scattering/radius of the specular highlight.
+
+    Example Materials:
+        Emerald 0.0215	0.1745	0.0215	0.07568	0.61424	0.07568	0.633	0.727811	0.633	0.6
+*/
+
+#endif
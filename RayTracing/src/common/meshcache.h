@@ -0,0 +1,55 @@
+#ifndef MESHCACHE_H
+#define MESHCACHE_H
+
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "material.h"
+#include "objreader.h"
+#include "triangle.h"
+
+/*
+ * MeshCache
+ * Obj meshes read once and shared by every scene that names them. The triangles, with what
+ * they precompute for intersection, are shared as they are, so their material ids point into
+ * the one table of materials the cache gathers from the meshes' mtl files. A scene's table
+ * starts as a copy of it, read after the scene's meshes, which keeps those ids valid
+ */
+class MeshCache {
+public:
+    MeshCache() {};
+    MeshCache(const MeshCache &) = delete;
+    MeshCache &operator=(const MeshCache &) = delete;
+
+    // Triangles of the obj file at path, null when it could not be read
+    const std::vector<std::shared_ptr<Triangle>> *Get(const std::string &path);
+
+    const MaterialTable &Materials() const { return m_materials; };
+    size_t Meshes() const { return m_meshes.size(); };
+
+private:
+    std::map<std::string, std::vector<std::shared_ptr<Triangle>>> m_meshes;
+    MaterialTable m_materials;
+};
+
+/*
+ * A file that failed is tried again each time it is named, so it is reported each time
+ */
+const std::vector<std::shared_ptr<Triangle>> *MeshCache::Get(const std::string &path) {
+    auto found = m_meshes.find(path);
+    if (found != m_meshes.end()) return &found->second;
+
+    // ObjReader takes a file it cannot open as an empty mesh
+    ObjReader obj(path, &m_materials);
+    if (!std::ifstream(path).is_open() || !obj.IsSuccess()) {
+        std::cerr << "Could not read mesh " << path << std::endl;
+        return nullptr;
+    }
+    return &(m_meshes[path] = obj.GetTris());
+}
+
+#endif
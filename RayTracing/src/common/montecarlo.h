@@ -1,18 +1,55 @@
 #ifndef MONTECARLO_H
 #define MONTECARLO_H
 
+#include <cmath>
+#include <cstdint>
 #include <random>
+#include <algorithm>
 
 #include "vec3.h"
 
 namespace MonteCarlo {
 
+const float PI = 3.14159265358979f;
+
 inline float RandomFloat() {
     static std::uniform_real_distribution<float> distribution(0.0, 1.0);
     static std::mt19937 generator;
     return distribution(generator);
 }
 
+/*
+ * Integer hash (lowbias32 by Chris Wellons), used for counter-based random numbers
+ */
+inline uint32_t Hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352du;
+    x ^= x >> 15;
+    x *= 0x846ca68bu;
+    x ^= x >> 16;
+    return x;
+}
+
+inline uint32_t HashCombine(uint32_t seed, uint32_t v) {
+    return seed ^ (Hash(v) + 0x9e3779b9u + (seed << 6) + (seed >> 2));
+}
+
+/*
+ * Combine a 64 bit pixel index into seed. Only the pixels of images past 2^32 pixels, which are
+ * only ever streamed, hash their high bits in too; the rest combine as their 32 bits would
+ */
+inline uint32_t HashPixel(uint32_t seed, uint64_t pixel) {
+    uint32_t h = HashCombine(seed, uint32_t(pixel));
+    return (pixel >> 32) ? HashCombine(h, uint32_t(pixel >> 32)) : h;
+}
+
+/*
+ * Map 32 random bits to a float in [0,1)
+ */
+inline float UintToFloat(uint32_t x) {
+    return std::min(float(x) * 2.3283064365386963e-10f, 0.99999994f);
+}
+
 inline Vec3 RandomVec() {
     while (true) {
         Vec3 v(RandomFloat(), RandomFloat(), RandomFloat());
@@ -21,6 +58,63 @@ inline Vec3 RandomVec() {
     }
 }
 
+/*
+ * Power heuristic weight for a sample from the strategy with density a against one with density b
+ */
+inline float PowerHeuristic(float a, float b) {
+    if (a <= 0.0f) return 0.0f;
+    return (a * a) / (a * a + b * b);
+}
+
+/*
+ * Build tangent t and bitangent b so that (t, b, n) is orthonormal
+ * Branchless construction from Duff et al. 2017, n must be unit length
+ */
+inline void OrthonormalBasis(const Dir3 &n, Dir3 &t, Dir3 &b) {
+    float sign = std::copysign(1.0f, n.z());
+    float a = -1.0f / (sign + n.z());
+    float c = n.x() * n.y() * a;
+    t = Dir3(1.0f + sign * n.x() * n.x() * a, sign * c, -sign * n.x());
+    b = Dir3(c, sign + n.y() * n.y() * a, -n.y());
+}
+
+/*
+ * Direction in the hemisphere about n with density cos(theta)/pi
+ * u1 and u2 are uniform in [0,1), n must be unit length
+ */
+inline Dir3 CosineHemisphere(const Dir3 &n, float u1, float u2, float &pdf) {
+    Dir3 t, b;
+    OrthonormalBasis(n, t, b);
+    float r = std::sqrt(u1);
+    float phi = 2.0f * PI * u2;
+    float z = std::sqrt(std::max(0.0f, 1.0f - u1));
+    pdf = z / PI;
+    return r * std::cos(phi) * t + r * std::sin(phi) * b + z * n;
+}
+
+inline float CosineHemispherePdf(const Dir3 &n, const Dir3 &d) {
+    return std::max(Dot(n, d), 0.0f) / PI;
+}
+
+/*
+ * Direction about axis with density (e+1)/(2pi) cos^e(theta)
+ * Inverts the lobe's cdf directly so there is no rejection loop
+ */
+inline Dir3 PowerCosineLobe(const Dir3 &axis, float e, float u1, float u2, float &pdf) {
+    Dir3 t, b;
+    OrthonormalBasis(axis, t, b);
+    float z = std::pow(u1, 1.0f / (e + 1.0f));
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    float phi = 2.0f * PI * u2;
+    pdf = (e + 1.0f) / (2.0f * PI) * std::pow(z, e);
+    return r * std::cos(phi) * t + r * std::sin(phi) * b + z * axis;
+}
+
+inline float PowerCosineLobePdf(const Dir3 &axis, float e, const Dir3 &d) {
+    float z = std::max(Dot(axis, d), 0.0f);
+    return (e + 1.0f) / (2.0f * PI) * std::pow(z, e);
+}
+
 }
 
 #endif
\ No newline at end of file
@@ -1,6 +1,9 @@
 #ifndef OBJECT_H
 #define OBJECT_H
 
+#include <cstdint>
+#include <vector>
+
 #include "ray.h"
 #include "surfel.h"
 #include "colour3.h"
@@ -8,54 +11,26 @@
 class Object {
 public:
     virtual bool Intersects(const Ray& r, float min, float max, Surfel& s) = 0;
-    void TransferMaterialProperties(Surfel& s) const {
-        s.Emission = Emission;
-        s.AmbientAlbedo = AmbientAlbedo;
-        s.LambertAlbedo = LambertAlbedo;
-        s.GlossyAlbedo = GlossyAlbedo;
-        s.Exponent = Exponent;
-        s.Impulse = Impulse;
-        s.ImpulseAlbedo = ImpulseAlbedo;
-
-        s.Ambient = Ambient;
-        s.Diffuse = Diffuse;
-        s.Specular = Specular;
-    }
-    
+
+    // Surface area and a point uniform by area with the normal there, from u and v in [0,1)
+    // Objects that cannot be sampled report no area and are never used as lights
+    virtual float Area() const { return 0.0f; };
+    virtual Point3 SamplePoint(float, float, Dir3& n) const { n = Dir3(); return Point3(); };
+
+    // Box around the object, and a cone around its normals given as an axis and the cos of its
+    // half angle. Used to bound what an emissive object can light
+    virtual void Bounds(Point3& lo, Point3& hi) const { lo = Point3(); hi = Point3(); };
+    virtual float NormalCone(Dir3& axis) const { axis = Dir3(0.0f, 0.0f, 1.0f); return -1.0f; };
+
+    // Triangles covering the object for rasterising, appended three corners at a time. Curved
+    // surfaces give a mesh that encloses them. Returns false when the object has no such mesh
+    virtual bool Tessellate(std::vector<Point3>&) const { return false; };
+    // Whether that mesh is the surface itself rather than one enclosing it
+    virtual bool TessellationIsExact() const { return true; };
+
 public:
-    Colour3 Emission = Colour3(0.0f, 0.0f, 0.0f);
-    float AmbientAlbedo = 0.7f;
-    float LambertAlbedo = 0.7;
-    float GlossyAlbedo = 0.7;
-    float Exponent = 20.0f;
-    float Impulse = 0.1;
-    float ImpulseAlbedo = 1.0f;
-
-    Colour3 Ambient = Colour3(0.2f, 0.2f, 0.2f);
-    Colour3 Diffuse = Colour3(0.7f, 0.7f, 0.7f);
-    Colour3 Specular = Colour3(1.0f, 1.0f, 1.0f);
+    // Index of the object's material in the MaterialTable of its ObjectList
+    uint16_t MaterialId = 0;
 };
 
-/*
-    Lighting and material explanation
-    
-    Ambient:
-        The ambient material vector defines what color the surface reflects under ambient lighting. 
-        This is usually the same as the surface's color
-   
-    Diffuse:
-        The diffuse material vector defines the color of the surface under diffuse lighting. 
-        The diffuse color is (just like ambient lighting) set to the desired surface's color.
-
-    Specular:
-        The specular material vector sets the color of the specular highlight on the surface 
-        (or possibly even reflect a surface-specific color).
-
-    Exponent:
-        The exponent impacts the scattering/radius of the specular highlight.
-
-    Example Materials:
-        Emerald 0.0215	0.1745	0.0215	0.07568	0.61424	0.07568	0.633	0.727811	0.633	0.6
-*/
-
 #endif
\ No newline at end of file
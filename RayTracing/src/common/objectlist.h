@@ -4,6 +4,7 @@
 #include <memory>
 #include <vector>
 
+#include "material.h"
 #include "object.h"
 
 class ObjectList {
@@ -14,10 +15,16 @@ class ObjectList {
         void clear() { objects.clear(); }
         void add(std::shared_ptr<Object> object) { objects.emplace_back(object); }
 
+        // The closest hit, with its material resolved
         bool DoesRayIntersectSurface(const Ray& r, float min, float max, Surfel& s) const;
 
+        // Fill the material fields of s from its MaterialId
+        void ResolveMaterial(Surfel& s) const;
+        const Material& MaterialOf(int object) const { return materials[objects[object]->MaterialId]; }
+
     public:
         std::vector<std::shared_ptr<Object>> objects;
+        MaterialTable materials;
 };
 
 bool ObjectList::DoesRayIntersectSurface(const Ray& r, float min, float max, Surfel& s) const {
@@ -25,14 +32,32 @@ bool ObjectList::DoesRayIntersectSurface(const Ray& r, float min, float max, Sur
     bool doesIntersect = false;
     float closest = max;
 
-    for (const auto& object : objects) {
-        if (object->Intersects(r, min, closest, tempS)) {
+    for (unsigned int i = 0; i < objects.size(); ++i) {
+        if (objects[i]->Intersects(r, min, closest, tempS)) {
             doesIntersect = true;
             closest = tempS.At;
             s = tempS;
+            s.ObjectId = i;
         }
     }
+    if (doesIntersect)
+        ResolveMaterial(s);
     return doesIntersect;
 }
 
+void ObjectList::ResolveMaterial(Surfel& s) const {
+    const Material &m = materials[s.MaterialId];
+    s.Emission = m.Emission;
+    s.AmbientAlbedo = m.AmbientAlbedo;
+    s.LambertAlbedo = m.LambertAlbedo;
+    s.GlossyAlbedo = m.GlossyAlbedo;
+    s.Exponent = m.Exponent;
+    s.Impulse = m.Impulse;
+    s.ImpulseAlbedo = m.ImpulseAlbedo;
+
+    s.Ambient = m.Ambient;
+    s.Diffuse = m.Diffuse;
+    s.Specular = m.Specular;
+}
+
 #endif
\ No newline at end of file
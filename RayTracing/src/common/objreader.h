@@ -7,8 +7,10 @@
 #include <vector>
 #include <string>
 #include <sstream>
+#include <map>
 #include <memory>
 
+#include "material.h"
 #include "triangle.h"
 #include "vec3.h"
 
@@ -18,16 +20,22 @@ const std::string VERTEX = "v";
 const std::string NORMAL = "vn";
 const std::string TEX = "vt";
 const std::string FACE = "f";
+const std::string MATERIAL_LIBRARY = "mtllib";
+const std::string USE_MATERIAL = "usemtl";
+const std::string NEW_MATERIAL = "newmtl";
 const char FACE_SEPERATOR = '/';
 }
 
 /*
  * ObjReader
  * Simple obj reader. Just call constructor with file name. Then use get methods for data if valid
+ * Given a MaterialTable, the mtl files the obj names are read into it and each triangle gets the
+ * id of the material in use where it was defined. Ka, Kd, Ks, Ke and Ns set Ambient, Diffuse,
+ * Specular, Emission and Exponent as ReadMaterialValue reads them, the rest keep their defaults
  */
 class ObjReader {
 public:
-    ObjReader(const std::string &f) : m_success(true) {
+    ObjReader(const std::string &f, MaterialTable *materials = nullptr) : m_success(true), m_materials(materials) {
         m_tri.clear();
         m_v.clear();
         m_n.clear();
@@ -40,6 +48,8 @@ public:
             if (tok == NORMAL) if (!ParseNormal()) { m_success = false; break; }
             if (tok == TEX) if (!ParseTex()) { m_success = false; break; }
             if (tok == FACE) if (!ParseFace()) { m_success = false; break; }
+            if (tok == MATERIAL_LIBRARY) if (!ParseMaterialLibrary(f)) { m_success = false; break; }
+            if (tok == USE_MATERIAL) if (!ParseUseMaterial()) { m_success = false; break; }
         }
 
         m_inf.close();
@@ -114,6 +124,7 @@ private:
         std::array<Dir3, 3> trin {m_n[vn[0]-1], m_n[vn[1]-1], m_n[vn[2]-1]};
         std::array<Tex2, 3> tritc {m_tc[vt[0]-1], m_tc[vt[1]-1], m_tc[vt[2]-1]};
         m_tri.emplace_back(std::make_shared<Triangle>(triv, trin, tritc));
+        m_tri.back()->MaterialId = m_material;
     }
 
     /*
@@ -132,9 +143,77 @@ private:
         return true;
     }
 
+    /*
+     * Rest of the line, without the spaces around it
+     */
+    bool ParseName(std::string &name) {
+        if (!std::getline(m_inf, name)) return false;
+        size_t end = name.find_last_not_of(" \t\r");
+        name = end == std::string::npos ? "" : name.substr(0, end + 1);
+        return !name.empty();
+    }
+
+    /*
+     * Library path is relative to the obj file. Materials are named in the table by library and
+     * name, so meshes using one library share its materials, while libraries reusing a name stay
+     * apart. A library that will not open leaves its materials as the default
+     */
+    bool ParseMaterialLibrary(const std::string &obj) {
+        std::string name;
+        if (!ParseName(name)) return false;
+        if (!m_materials) return true;
+
+        std::string path = obj.substr(0, obj.find_last_of('/') + 1) + name;
+        std::ifstream mtl(path, std::ifstream::in);
+        if (!mtl.is_open()) {
+            std::cerr << "Could not open " << path << std::endl;
+            return true;
+        }
+
+        std::string line;
+        uint16_t id = 0;
+        bool defining = false;
+        while (std::getline(mtl, line)) {
+            std::stringstream ss(line);
+            std::string key;
+            if (!(ss >> key)) continue;
+            if (key == NEW_MATERIAL) {
+                std::string material;
+                ss >> material;
+                // One read through another mesh is shared as it is
+                id = m_materials->Find(path + ":" + material);
+                defining = id == 0;
+                if (defining) {
+                    id = m_materials->Add(Material(), path + ":" + material);
+                    defining = id != 0;
+                }
+                m_materialIds[material] = id;
+                continue;
+            }
+            // Keys of no use here, such as illum, are skipped
+            if (defining)
+                ReadMaterialValue(key, ss, (*m_materials)[id]);
+        }
+        return true;
+    }
+
+    /*
+     * Names from no library read give the default material
+     */
+    bool ParseUseMaterial() {
+        std::string name;
+        if (!ParseName(name)) return false;
+        auto found = m_materialIds.find(name);
+        m_material = found == m_materialIds.end() ? 0 : found->second;
+        return true;
+    }
+
 private:
     std::ifstream m_inf;
     bool m_success;
+    MaterialTable *m_materials;
+    std::map<std::string, uint16_t> m_materialIds;
+    uint16_t m_material = 0;
     std::vector<std::shared_ptr<Triangle>> m_tri;
     std::vector<Point3> m_v;
     std::vector<Dir3> m_n;
@@ -0,0 +1,53 @@
+#ifndef PARALLEL_H
+#define PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace Parallel {
+
+// Threads to use when asked for zero
+inline int DefaultThreads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/*
+ * Run f(begin, end) over [0,count) split into chunks of chunk items
+ * Threads take the next chunk from a shared counter until none are left, so uneven chunks
+ * balance out. The calling thread works too
+ */
+template <typename F>
+void For(int count, int chunk, int threads, F f) {
+    if (count <= 0) return;
+    if (threads <= 0) threads = DefaultThreads();
+    chunk = std::max(chunk, 1);
+    const int chunks = (count + chunk - 1) / chunk;
+    threads = std::min(threads, chunks);
+
+    std::atomic<int> next(0);
+    auto work = [&]() {
+        for (int c = next++; c < chunks; c = next++)
+            f(c * chunk, std::min(count, (c + 1) * chunk));
+    };
+
+    std::vector<std::thread> pool;
+    for (int t = 1; t < threads; ++t)
+        pool.emplace_back(work);
+    work();
+    for (auto &t : pool)
+        t.join();
+}
+
+/*
+ * Add to an atomic float, retrying when another thread got there first
+ */
+inline void AtomicAdd(std::atomic<float> &target, float value) {
+    float current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed));
+}
+
+}
+
+#endif
@@ -0,0 +1,24 @@
+#ifndef PATHVERTEX_H
+#define PATHVERTEX_H
+
+#include "surfel.h"
+
+/*
+ * PathVertex
+ * One vertex of a camera or light subpath in bidirectional path tracing (Veach 1997)
+ * Densities are per unit area. PdfFwd is that of the vertex's own subpath reaching it, PdfRev that
+ * of the other subpath reaching it from the opposite direction, as needed to weigh strategies
+ */
+struct PathVertex {
+    enum Kind { Camera, Emitter, Surface };
+
+    Kind Type = Surface;
+    Surfel S; // Point and unit Normal are used for every kind, the rest only for surfaces
+    float Beta = 1.0f; // Throughput from the start of the subpath over the density of getting here
+    float PdfFwd = 0.0f;
+    float PdfRev = 0.0f;
+    bool Delta = false; // The path left by an impulse, which no connection can take
+    int Light = -1; // For emitters, the entry of the light table the subpath started from
+};
+
+#endif
@@ -0,0 +1,128 @@
+#ifndef PHOTONMAP_H
+#define PHOTONMAP_H
+
+#include <vector>
+#include <algorithm>
+
+#include "vec3.h"
+
+/*
+ * Photon
+ * Flux arriving at a point from direction In, which points back the way the photon came
+ */
+struct Photon {
+    Point3 Position;
+    Dir3 In;
+    float Power[3];
+    int Axis = 0; // Split axis of the kd-tree node this photon ends up as
+};
+
+/*
+ * PhotonMap
+ * Photons in a balanced kd-tree stored as a flat array, each subtree is a contiguous range
+ * with its median photon in the middle, so no child pointers are needed
+ */
+class PhotonMap {
+public:
+    void Build(std::vector<Photon> photons);
+    void Clear() { m_photons.clear(); };
+    bool Empty() const { return m_photons.empty(); };
+    int Size() const { return m_photons.size(); };
+
+    /*
+     * Up to k photons nearest p within radius, as pointers into the map
+     * Returns the squared distance the search ended at: that of the k-th nearest photon when
+     * k were found, radius squared otherwise
+     */
+    float Nearest(const Point3 &p, int k, float radius, std::vector<const Photon*> &found) const;
+
+private:
+    void Balance(int begin, int end);
+    void Search(int begin, int end, const Point3 &p, int k, float &maxDistance2,
+                std::vector<std::pair<float, const Photon*>> &heap) const;
+
+    static float Coordinate(const Point3 &p, int axis) {
+        return axis == 0 ? p.x() : (axis == 1 ? p.y() : p.z());
+    }
+
+    std::vector<Photon> m_photons;
+};
+
+void PhotonMap::Build(std::vector<Photon> photons) {
+    m_photons = std::move(photons);
+    Balance(0, m_photons.size());
+}
+
+/*
+ * Put the median along the widest axis of [begin,end) in the middle, then balance each side
+ */
+void PhotonMap::Balance(int begin, int end) {
+    if (end - begin <= 1) return;
+
+    Point3 lo = m_photons[begin].Position, hi = lo;
+    for (int i = begin + 1; i < end; ++i) {
+        const Point3 &q = m_photons[i].Position;
+        lo = Point3(std::min(lo.x(), q.x()), std::min(lo.y(), q.y()), std::min(lo.z(), q.z()));
+        hi = Point3(std::max(hi.x(), q.x()), std::max(hi.y(), q.y()), std::max(hi.z(), q.z()));
+    }
+    Dir3 extent = hi - lo;
+    int axis = 0;
+    if (extent.y() > extent.x()) axis = 1;
+    if (extent.z() > Coordinate(extent, axis)) axis = 2;
+
+    int mid = begin + (end - begin) / 2;
+    std::nth_element(m_photons.begin() + begin, m_photons.begin() + mid, m_photons.begin() + end,
+                     [axis](const Photon &a, const Photon &b) {
+                         return Coordinate(a.Position, axis) < Coordinate(b.Position, axis);
+                     });
+    m_photons[mid].Axis = axis;
+    Balance(begin, mid);
+    Balance(mid + 1, end);
+}
+
+float PhotonMap::Nearest(const Point3 &p, int k, float radius, std::vector<const Photon*> &found) const {
+    found.clear();
+    float maxDistance2 = radius * radius;
+    if (m_photons.empty() || k <= 0) return maxDistance2;
+
+    // Max heap on distance, its top is the furthest photon kept so far
+    std::vector<std::pair<float, const Photon*>> heap;
+    heap.reserve(k + 1);
+    Search(0, m_photons.size(), p, k, maxDistance2, heap);
+
+    for (const auto &h : heap) found.push_back(h.second);
+    return maxDistance2;
+}
+
+void PhotonMap::Search(int begin, int end, const Point3 &p, int k, float &maxDistance2,
+                       std::vector<std::pair<float, const Photon*>> &heap) const {
+    if (begin >= end) return;
+    int mid = begin + (end - begin) / 2;
+    const Photon &photon = m_photons[mid];
+
+    // Near side first so the far side is more often cut off
+    float delta = Coordinate(p, photon.Axis) - Coordinate(photon.Position, photon.Axis);
+    if (end - begin > 1) {
+        if (delta < 0.0f) {
+            Search(begin, mid, p, k, maxDistance2, heap);
+            if (delta * delta < maxDistance2) Search(mid + 1, end, p, k, maxDistance2, heap);
+        } else {
+            Search(mid + 1, end, p, k, maxDistance2, heap);
+            if (delta * delta < maxDistance2) Search(begin, mid, p, k, maxDistance2, heap);
+        }
+    }
+
+    float distance2 = (photon.Position - p).LengthSquared();
+    if (distance2 >= maxDistance2) return;
+    heap.emplace_back(distance2, &photon);
+    std::push_heap(heap.begin(), heap.end());
+    if (int(heap.size()) > k) {
+        std::pop_heap(heap.begin(), heap.end());
+        heap.pop_back();
+    }
+    // Once full, only photons closer than the furthest kept can matter
+    if (int(heap.size()) == k)
+        maxDistance2 = heap.front().first;
+}
+
+#endif
@@ -0,0 +1,59 @@
+#ifndef PIXELSTATS_H
+#define PIXELSTATS_H
+
+#include <cmath>
+#include <algorithm>
+#include <limits>
+
+#include "colour3.h"
+
+/*
+ * PixelStats
+ * Running sum of the samples of one pixel, with the luminance variance kept online by
+ * Welford's method so the error estimate is available after every sample
+ */
+class PixelStats {
+public:
+    PixelStats() {};
+
+    void Add(const Colour3 &c) {
+        m_r += c.r();
+        m_g += c.g();
+        m_b += c.b();
+        ++m_n;
+
+        float x = Luminance(c);
+        float delta = x - m_mean;
+        m_mean += delta / m_n;
+        m_m2 += delta * (x - m_mean);
+    }
+
+    int Count() const { return m_n; };
+
+    Colour3 Mean() const {
+        if (m_n == 0) return Colour3(0.0f, 0.0f, 0.0f);
+        float scale = 1.0f / m_n;
+        return Colour3(m_r * scale, m_g * scale, m_b * scale);
+    }
+
+    float Variance() const { return m_n > 1 ? m_m2 / (m_n - 1) : 0.0f; };
+
+    /*
+     * Standard error of the mean luminance relative to the mean
+     * The mean is floored so dark pixels do not soak up the whole budget
+     */
+    float RelativeError() const {
+        if (m_n < 2) return std::numeric_limits<float>::infinity();
+        return std::sqrt(Variance() / m_n) / std::max(m_mean, 0.1f);
+    }
+
+private:
+    float m_r = 0.0f;
+    float m_g = 0.0f;
+    float m_b = 0.0f;
+    int m_n = 0;
+    float m_mean = 0.0f;
+    float m_m2 = 0.0f;
+};
+
+#endif
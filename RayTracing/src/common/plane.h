@@ -2,6 +2,7 @@
 #define PLANE_H
 
 #include <vector>
+#include <algorithm>
 
 #include "object.h"
 #include "vec3.h"
@@ -16,6 +17,14 @@ public:
                 m_tri.emplace_back(SimpleTriangle(ll, rl, ru, n));
             };
     virtual bool Intersects(const Ray& r, float min, float max, Surfel& s) override;
+    virtual float Area() const override;
+    virtual Point3 SamplePoint(float u, float v, Dir3& n) const override;
+    virtual void Bounds(Point3& lo, Point3& hi) const override;
+    virtual float NormalCone(Dir3& axis) const override { return m_tri[0].NormalCone(axis); };
+    virtual bool Tessellate(std::vector<Point3>& corners) const override {
+        for (const auto &tri : m_tri) tri.Tessellate(corners);
+        return true;
+    };
 
 private:
     std::vector<SimpleTriangle> m_tri;
@@ -27,11 +36,33 @@ bool Plane::Intersects(const Ray& r, float min, float max, Surfel& s) {
     for (unsigned int i = 0; i < m_tri.size(); ++i) {
         doesIntersect = m_tri[i].Intersects(r, min, max, s);
         if (doesIntersect) {
-            TransferMaterialProperties(s);
+            s.MaterialId = MaterialId;
             return true;
         }
     }
     return false;
 }
 
+float Plane::Area() const {
+    float area = 0.0f;
+    for (const auto &tri : m_tri) area += tri.Area();
+    return area;
+}
+
+Point3 Plane::SamplePoint(float u, float v, Dir3& n) const {
+    // Pick a triangle by area and reuse u within it
+    float first = m_tri[0].Area() / Area();
+    if (u < first)
+        return m_tri[0].SamplePoint(u / first, v, n);
+    return m_tri[1].SamplePoint(std::min((u - first) / (1.0f - first), 0.99999994f), v, n);
+}
+
+void Plane::Bounds(Point3& lo, Point3& hi) const {
+    Point3 lo1, hi1;
+    m_tri[0].Bounds(lo, hi);
+    m_tri[1].Bounds(lo1, hi1);
+    lo = Point3(std::min(lo.x(), lo1.x()), std::min(lo.y(), lo1.y()), std::min(lo.z(), lo1.z()));
+    hi = Point3(std::max(hi.x(), hi1.x()), std::max(hi.y(), hi1.y()), std::max(hi.z(), hi1.z()));
+}
+
 #endif
\ No newline at end of file
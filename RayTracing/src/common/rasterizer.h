@@ -0,0 +1,210 @@
+#ifndef RASTERIZER_H
+#define RASTERIZER_H
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "camera.h"
+#include "objectlist.h"
+#include "vec3.h"
+
+/*
+ * Rasterizer
+ * Primary visibility by z-buffer in place of casting camera rays. The objects are tessellated,
+ * clipped in front of the camera and set up in film space once, then binned into square tiles of
+ * pixels. Each tile is resolved on its own into a visibility buffer holding the nearest object of
+ * every sample, so threads working on different tiles share nothing
+ */
+class Rasterizer {
+public:
+    static const int TileSize = 16;
+
+    /*
+     * Set up the scene for an image of width by height pixels, pixel i covering film u from
+     * i/(width-1) to (i+1)/(width-1) as camera rays do, and rows counted from the top
+     * Returns false when some object cannot be tessellated, as the buffer would miss it
+     */
+    bool Build(const ObjectList &objl, const Camera &cam, int width, int height);
+
+    int Tiles() const { return m_tilesX * m_tilesY; };
+
+    // Pixel columns [x0,x1) and rows [y0,y1) of a tile
+    void TileBounds(int tile, int &x0, int &y0, int &x1, int &y1) const;
+
+    /*
+     * Nearest object under each sample of a tile, -1 where there is none
+     * Samples come pixel by pixel along the tile's rows, perPixel of them to a pixel, as film
+     * coordinates u and v
+     */
+    void Resolve(int tile, int perPixel, const float *u, const float *v, int *ids) const;
+
+private:
+    // Barycentrics and inverse depth as planes over film space, l = a * u + b * v + c
+    struct Setup {
+        float A[3], B[3], C[3];
+        float ZA, ZB, ZC;
+        int Object;
+        int X0, X1, Y0, Y1; // Pixels the triangle's bounds cover, inclusive
+    };
+
+    struct Clip {
+        float X, Y, W;
+    };
+
+    void Add(const Clip &p0, const Clip &p1, const Clip &p2, int object);
+
+    std::vector<Setup> m_triangles;
+    std::vector<std::vector<int>> m_bins; // Triangles overlapping each tile, in object order
+    int m_width = 0, m_height = 0;
+    int m_tilesX = 0, m_tilesY = 0;
+};
+
+bool Rasterizer::Build(const ObjectList &objl, const Camera &cam, int width, int height) {
+    m_width = width;
+    m_height = height;
+    m_tilesX = (width + TileSize - 1) / TileSize;
+    m_tilesY = (height + TileSize - 1) / TileSize;
+    m_triangles.clear();
+    m_bins.assign(Tiles(), std::vector<int>());
+
+    // Closer than this to the camera is cut off, keeping w away from zero
+    const float near = 1e-3f;
+
+    std::vector<Point3> corners;
+    for (unsigned int i = 0; i < objl.objects.size(); ++i) {
+        corners.clear();
+        if (!objl.objects[i]->Tessellate(corners))
+            return false;
+
+        for (size_t k = 0; k + 2 < corners.size(); k += 3) {
+            Clip in[3];
+            for (int c = 0; c < 3; ++c)
+                cam.Homogeneous(corners[k + c], in[c].X, in[c].Y, in[c].W);
+
+            // Cut the triangle at w = near, which may leave a quad to fan out
+            Clip out[4];
+            int n = 0;
+            for (int c = 0; c < 3; ++c) {
+                const Clip &a = in[c], &b = in[(c + 1) % 3];
+                if (a.W >= near) out[n++] = a;
+                if ((a.W >= near) != (b.W >= near)) {
+                    float t = (near - a.W) / (b.W - a.W);
+                    out[n++] = {a.X + t * (b.X - a.X), a.Y + t * (b.Y - a.Y), near};
+                }
+            }
+            for (int c = 2; c < n; ++c)
+                Add(out[0], out[c - 1], out[c], i);
+        }
+    }
+
+    for (int t = 0; t < int(m_triangles.size()); ++t) {
+        const Setup &s = m_triangles[t];
+        for (int ty = s.Y0 / TileSize; ty <= s.Y1 / TileSize; ++ty)
+            for (int tx = s.X0 / TileSize; tx <= s.X1 / TileSize; ++tx)
+                m_bins[ty * m_tilesX + tx].push_back(t);
+    }
+    return true;
+}
+
+void Rasterizer::Add(const Clip &p0, const Clip &p1, const Clip &p2, int object) {
+    const float u[3] = {p0.X / p0.W, p1.X / p1.W, p2.X / p2.W};
+    const float v[3] = {p0.Y / p0.W, p1.Y / p1.W, p2.Y / p2.W};
+    const float z[3] = {1.0f / p0.W, 1.0f / p1.W, 1.0f / p2.W};
+
+    float area = (u[1] - u[0]) * (v[2] - v[0]) - (v[1] - v[0]) * (u[2] - u[0]);
+    if (!(std::abs(area) > 1e-12f)) return;
+
+    const float lastX = m_width - 1, lastY = m_height - 1;
+    float uLo = std::min({u[0], u[1], u[2]}), uHi = std::max({u[0], u[1], u[2]});
+    float vLo = std::min({v[0], v[1], v[2]}), vHi = std::max({v[0], v[1], v[2]});
+    if (uHi < 0.0f || vHi < 0.0f || uLo * lastX >= m_width || vLo * lastY >= m_height) return;
+
+    Setup s;
+    s.Object = object;
+    s.X0 = std::max(0, int(std::floor(uLo * lastX)));
+    s.X1 = std::min(m_width - 1, int(std::floor(uHi * lastX)));
+    // Film v grows upwards, rows downwards
+    s.Y0 = std::max(0, m_height - 1 - int(std::floor(vHi * lastY)));
+    s.Y1 = std::min(m_height - 1, m_height - 1 - int(std::floor(vLo * lastY)));
+
+    // The barycentric of each corner is the signed area it makes with the opposite edge
+    for (int c = 0; c < 3; ++c) {
+        int a = (c + 1) % 3, b = (c + 2) % 3;
+        s.A[c] = (v[a] - v[b]) / area;
+        s.B[c] = (u[b] - u[a]) / area;
+        s.C[c] = (u[a] * v[b] - u[b] * v[a]) / area;
+    }
+    // 1/w is linear in film space, so the depth test is exact for flat triangles
+    s.ZA = s.A[0] * z[0] + s.A[1] * z[1] + s.A[2] * z[2];
+    s.ZB = s.B[0] * z[0] + s.B[1] * z[1] + s.B[2] * z[2];
+    s.ZC = s.C[0] * z[0] + s.C[1] * z[1] + s.C[2] * z[2];
+    m_triangles.push_back(s);
+}
+
+void Rasterizer::TileBounds(int tile, int &x0, int &y0, int &x1, int &y1) const {
+    x0 = (tile % m_tilesX) * TileSize;
+    y0 = (tile / m_tilesX) * TileSize;
+    x1 = std::min(x0 + TileSize, m_width);
+    y1 = std::min(y0 + TileSize, m_height);
+}
+
+/*
+ * Each triangle runs over the samples of the pixels it may cover, a row of the tile at a time
+ * The samples of a row are contiguous, so they are tested four to an SSE register with masks
+ * in place of branches. Ties in depth go to the later object, as in ray casting
+ */
+void Rasterizer::Resolve(int tile, int perPixel, const float *u, const float *v, int *ids) const {
+    int x0, y0, x1, y1;
+    TileBounds(tile, x0, y0, x1, y1);
+    const int width = x1 - x0;
+    const int count = width * (y1 - y0) * perPixel;
+
+    // Inverse depth of the nearest hit so far, zero being infinitely far
+    std::vector<float> depth(count, 0.0f);
+    std::fill(ids, ids + count, -1);
+
+    for (int t : m_bins[tile]) {
+        const Setup &s = m_triangles[t];
+        const int xBegin = std::max(s.X0, x0) - x0, xEnd = std::min(s.X1 + 1, x1) - x0;
+        for (int y = std::max(s.Y0, y0); y <= std::min(s.Y1, y1 - 1); ++y) {
+            const int begin = ((y - y0) * width + xBegin) * perPixel;
+            const int end = ((y - y0) * width + xEnd) * perPixel;
+            int k = begin;
+#if defined(__SSE2__)
+            const __m128 zero = _mm_setzero_ps();
+            const __m128i object = _mm_set1_epi32(s.Object);
+            auto plane = [](float a, float b, float c, __m128 pu, __m128 pv) {
+                return _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_set1_ps(a), pu), _mm_mul_ps(_mm_set1_ps(b), pv)), _mm_set1_ps(c));
+            };
+            for (; k + 4 <= end; k += 4) {
+                __m128 pu = _mm_loadu_ps(u + k), pv = _mm_loadu_ps(v + k);
+                __m128 d = _mm_loadu_ps(&depth[k]);
+                __m128 z = plane(s.ZA, s.ZB, s.ZC, pu, pv);
+                __m128 hit = _mm_cmpge_ps(z, d);
+                for (int c = 0; c < 3; ++c)
+                    hit = _mm_and_ps(hit, _mm_cmpge_ps(plane(s.A[c], s.B[c], s.C[c], pu, pv), zero));
+                _mm_storeu_ps(&depth[k], _mm_or_ps(_mm_and_ps(hit, z), _mm_andnot_ps(hit, d)));
+                __m128i mask = _mm_castps_si128(hit);
+                __m128i id = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ids + k));
+                id = _mm_or_si128(_mm_and_si128(mask, object), _mm_andnot_si128(mask, id));
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(ids + k), id);
+            }
+#endif
+            for (; k < end; ++k) {
+                float l0 = s.A[0] * u[k] + s.B[0] * v[k] + s.C[0];
+                float l1 = s.A[1] * u[k] + s.B[1] * v[k] + s.C[1];
+                float l2 = s.A[2] * u[k] + s.B[2] * v[k] + s.C[2];
+                float z = s.ZA * u[k] + s.ZB * v[k] + s.ZC;
+                bool hit = (l0 >= 0.0f) & (l1 >= 0.0f) & (l2 >= 0.0f) & (z >= depth[k]);
+                depth[k] = hit ? z : depth[k];
+                ids[k] = hit ? s.Object : ids[k];
+            }
+        }
+    }
+}
+
+#endif
@@ -6,34 +6,348 @@
 #include <limits>
 #include <memory>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <string>
 #include <vector>
 
+#include "aliastable.h"
+#include "arealights.h"
+#include "asyncwriter.h"
 #include "camera.h"
+#include "checkpoint.h"
 #include "colour3.h"
+#include "denoiser.h"
+#include "framebuffer.h"
+#include "gbuffer.h"
+#include "imagefile.h"
 #include "image.h"
+#include "irradiancecache.h"
 #include "light.h"
+#include "lightbvh.h"
 #include "montecarlo.h"
 #include "object.h"
 #include "objectlist.h"
+#include "parallel.h"
+#include "pathvertex.h"
+#include "photonmap.h"
+#include "pixelstats.h"
+#include "rasterizer.h"
+#include "reservoir.h"
+#include "sampler.h"
+#include "sdtree.h"
+#include "splatbuffer.h"
+#include "tiledtiff.h"
+#include "tonemapper.h"
 #include "vec3.h"
 
 const float infinity = std::numeric_limits<float>::infinity();
 
+/*
+ * PathState
+ * What a path carries from one vertex to the next
+ */
+struct PathState {
+    int Depth = 0;
+    float Throughput = 1.0f;
+
+    // Density with which the previous vertex's Blinn-Phong sampling chose the current ray,
+    // zero for camera rays and impulse bounces. Point and normal are where it was chosen
+    float LastPdf = 0.0f;
+    Point3 LastPoint;
+    Dir3 LastNormal;
+
+    // The previous vertex took all of its direct light from a ReSTIR reservoir
+    bool LightsResampled = false;
+
+    // Every bounce so far was an impulse, so the irradiance cache may serve this vertex
+    bool Specular = true;
+
+    // Bounces so far that were not impulses, which Incremental counts against TrackDepth
+    int Scattered = 0;
+};
+
 class RayTracer {
 public:
     RayTracer(ObjectList objl, Camera cam, Image img) : m_objl(objl), m_cam(cam), m_img(img) {};
     int Exec();
 
+    // Edits to the material table, the objects' material ids and the point lights, making one
+    // variant of the scene
+    using Variant = std::function<void(ObjectList &objects, std::vector<Light> &lights)>;
+
+    /*
+     * One image per variant, top row first, all shaded from the same cached first hits
+     * Each variant starts from the scene as it is now, its edits are undone once its image is done
+     */
+    std::vector<std::vector<Colour3>> RenderVariants(const std::vector<Variant> &variants);
+
+    // The RayTracer's own copy of the scene's materials, to edit between Execs
+    MaterialTable &Materials() { return m_objl.materials; };
+
+    // Mark an object whose material was edited, or that moved, for the next Incremental Exec
+    void Invalidate(int object, bool moved = false);
+    // Mark every object using a material of the table that was edited
+    void InvalidateMaterial(uint16_t material);
+
+    // Ask a Progressive Exec to stop, from any thread. Every Exec starts without the request, so
+    // one made while no Progressive Exec runs is dropped
+    void Cancel() { m_cancel = true; };
+
+public:
+    // Point lights. Exec lights the scene with one white light near the ceiling when left empty
+    std::vector<Light> Lights;
+
+    // Path termination. Paths always reach MinDepth bounces, after which Russian roulette
+    // decides on the path throughput whether to continue, never with more than MaxSurvival
+    // chance so that even bright paths end. No path goes past MaxDepth
+    int MinDepth = 3;
+    int MaxDepth = 10;
+    float MaxSurvival = 0.95f;
+
+    // Source of every random number a path uses, indexed by pixel, sample and dimension
+    std::shared_ptr<Sampler> PathSampler = std::make_shared<SobolSampler>();
+
+    // Adaptive sampling. Every pixel gets MinSamples, then the rest of the budget of
+    // NumberOfSamples per pixel goes to pixels whose relative error is above ErrorThreshold
+    bool Adaptive = false;
+    int MinSamples = 8;
+    float ErrorThreshold = 0.02f;
+    float TimeBudget = 0.0f; // Seconds, no limit when zero
+    std::string SampleMapPath = "samples.pgm";
+
+    // Light selection. With LightTree on, LightSamples lights are picked per shading point from
+    // a light BVH by their estimated contribution. Off, every point light is visited and one
+    // area light is picked by power
+    bool LightTree = true;
+    int LightSamples = 1;
+
+    // ReSTIR direct lighting at the first hit. Each pixel streams RestirCandidates light samples
+    // through a reservoir, merges the reservoir the same pixel kept in the previous pass or the
+    // previous Exec (temporal reuse) and then RestirNeighbours reservoirs from within
+    // RestirRadius pixels (spatial reuse). Later bounces sample lights as usual
+    bool Restir = false;
+    int RestirCandidates = 8;
+    bool RestirTemporal = true;
+    int RestirNeighbours = 4;
+    float RestirRadius = 10.0f;
+
+    // Denoising. With Denoise on, the averaged image goes through Filter before it is written.
+    // The first hit's albedo, normal and depth guide the filter; WriteAovs also writes them out
+    // as images named from AovPrefix
+    bool Denoise = false;
+    Denoiser Filter;
+    bool WriteAovs = false;
+    std::string AovPrefix = "aov_";
+
+    // Irradiance caching. Diffuse indirect light seen from the camera, directly or through impulse
+    // reflections, is interpolated from Cache, which gains a record of CacheRays hemisphere
+    // samples wherever none is close enough. Glossy and impulse reflection are still path traced
+    bool IrradianceCaching = false;
+    int CacheRays = 128;
+    IrradianceCache Cache;
+
+    // Caustic photon map. Before rendering, CausticPhotons photons leave the point lights, each
+    // light sending a share in proportion to its power. Those that reach a surface through impulse
+    // reflections are kept, and each shading point estimates caustic light from its
+    // CausticNeighbours nearest photons within CausticRadius
+    bool Caustics = false;
+    int CausticPhotons = 200000;
+    float CausticRadius = 0.05f;
+    int CausticNeighbours = 64;
+
+    // Path guiding. Samples go in iterations of doubling size that teach an SD-tree where light
+    // arrives from, until about half the budget is spent; the rest goes in one last iteration
+    // and the iterations are blended by how noisy each turned out. Indirect bounces
+    // take their direction from the tree with GuidingFraction chance, from the BRDF otherwise.
+    // A region splits once it records GuidingSplit times the root of the iteration's samples
+    bool Guiding = false;
+    float GuidingFraction = 0.5f;
+    float GuidingSplit = 12000.0f;
+
+    // Bidirectional path tracing, in place of TraceRay. Each sample traces a camera subpath and a
+    // light subpath and joins every pair of their vertices, weighting the strategies with the
+    // power heuristic. Light subpaths seen straight from the camera are splatted into whichever
+    // pixel they land in
+    bool Bidirectional = false;
+
+    // Hybrid rendering. The first hits of camera rays come from rasterising the scene into a
+    // visibility buffer, a tile of pixels at a time, rather than from casting the rays. Shading
+    // and every later bounce are still ray traced. Applies to the plain sample loop, when every
+    // object can be tessellated
+    bool Rasterize = false;
+
+    // First hit reuse. The plain sample loop keeps where every camera sample first landed, and
+    // later Execs with the same image and sampler shade from there without casting camera rays,
+    // so edits to lights and materials re-render at the cost of shading alone. The hits are cast
+    // again after Invalidate reports a moved object. Takes the place of Rasterize
+    bool CacheFirstHits = false;
+
+    // Incremental rendering. Exec keeps the image and, for every pixel, which objects its paths
+    // hit before their TrackDepth-th bounce that is not an impulse, so objects seen through
+    // chains of mirrors count as seen. Once Invalidate marks objects whose material was
+    // edited, the next Exec renders only the pixels that saw them again and keeps the rest, so
+    // light those pixels get over longer paths is left as it was. Edits to the lights or to an
+    // emissive object render everything. A move also renders the pixels the object's bounds
+    // cover on screen before and after it; shadow rays are not tracked, so shadows it now casts
+    // elsewhere, and its new reflections, are left as they were. Uses the plain sample loop
+    bool Incremental = false;
+    int TrackDepth = 2;
+
+    // Checkpointing. With CheckpointPath set, the plain sample loop goes in passes of PassSamples
+    // samples per pixel. After a pass, once CheckpointInterval seconds have gone by since the last
+    // save, every pixel's running sums and sample count go to the file, which is mapped into
+    // memory. With Resume on, Exec first takes the pixels from the file and carries on from each
+    // pixel's count. Samples depend only on pixel and index, so the image is the same as that of
+    // a render never stopped. Denoiser features are not kept. Progressive passes save to the
+    // file in the same way, and also when they stop early
+    std::string CheckpointPath;
+    float CheckpointInterval = 60.0f;
+    int PassSamples = 4;
+    bool Resume = false;
+
+    // Progressive rendering. The plain sample loop goes over the whole image in passes, each
+    // doubling the samples of every pixel, up to NumberOfSamples. It stops early once TimeBudget
+    // seconds have gone by or RayBudget ray segments have been traced, or on Cancel, finishing
+    // only the pixel at hand. The image so far is written to ProgressPath after every pass, in
+    // the format its extension names as --output would take it
+    //
+    // Exec uses the first of Restir, Adaptive, Guiding, Bidirectional, Incremental,
+    // CacheFirstHits, Progressive, checkpointing and Rasterize that is on, with StreamPath
+    // taking the place of all of them. Progressive also checkpoints; any other mode that is on
+    // is reported as ignored
+    bool Progressive = false;
+    unsigned long RayBudget = 0; // No limit when zero
+    std::string ProgressPath = "progress.ppm";
+
+    // Output. Light is summed and averaged unclamped, as linear radiance in a Framebuffer, and
+    // Display turns it into 8 bit values once, as the image is written. Exec writes the image to
+    // OutputPath as OutputFormat, to stdout when OutputPath is empty. The plain sample loop hands
+    // finished rows of a P3 or P6 image to a writer thread as it goes; otherwise the file goes in
+    // a single write at the end
+    ToneMapper Display;
+    std::string OutputPath;
+    ImageFormat OutputFormat = ImageFormat::P3;
+
+    // Streaming output. With StreamPath set, Exec renders with the plain sample loop a tile of
+    // StreamTileSize pixels square at a time per thread, writes each tile to a tiled TIFF at
+    // StreamPath through Display as soon as it is finished and lets it go. Memory then grows with
+    // the tiles in flight rather than the image, for images too large to hold. Nothing goes to
+    // OutputPath, and denoising and AOVs, which need the whole image, are left out. Pixels are
+    // numbered with 64 bits here, so images past 2^32 pixels keep a sample sequence per pixel;
+    // without StreamPath, Exec refuses images of more than 2^31 - 1 pixels
+    std::string StreamPath;
+    int StreamTileSize = 64;
+
+    // Threads for work done in parallel, all cores when zero
+    int Threads = 0;
+
 private:
-    Colour3 TraceRay(Ray r, float min, float max, int depth);
+    void SamplePixel(uint64_t pixel, PixelStats &stats, uint32_t first = 0);
+    void RenderGuided(std::vector<PixelStats> &stats);
+    float ScatterPdf(const Surfel &s, Dir3 out, Dir3 in, bool cached) const;
+    void SceneBounds(Point3 &lo, Point3 &hi) const;
+    void RenderBidirectional(std::vector<PixelStats> &stats);
+    void RenderRasterized(std::vector<PixelStats> &stats);
+    Colour3 ShadeFirstHit(const Ray &r, int object, const PixelSample &ps);
+    Colour3 ShadeCameraHit(const Ray &r, Surfel *s, const PixelSample &ps);
+    void FillFirstHits();
+    void RenderCached(std::vector<PixelStats> &stats);
+    void RenderIncremental(std::vector<PixelStats> &stats);
+    bool OpenCheckpoint(Checkpoint &file, std::vector<PixelStats> &stats) const;
+    void RenderCheckpointed(std::vector<PixelStats> &stats);
+    uint32_t SceneFingerprint() const;
+    void RenderProgressive(std::vector<PixelStats> &stats);
+    void WriteProgress(const std::vector<PixelStats> &stats, AsyncWriter &writer) const;
+    bool RenderPlain(std::vector<PixelStats> &stats, bool &wrote);
+    bool RenderStreamed();
+    void Touch(int pixel, int object);
+    bool CoverOnScreen(const Point3 &lo, const Point3 &hi, std::vector<char> &covered) const;
+    static Light DefaultLight();
+    void PrepareScene();
+    void ReportIgnoredModes() const;
+    std::vector<Colour3> FinalPixels(const std::vector<PixelStats> &stats);
+    bool WriteImage(const Framebuffer &frame, const std::string &path, ImageFormat format) const;
+    void SampleBidirectional(uint32_t pixel, PixelStats &stats, SplatBuffer &splats);
+    int CameraSubpath(const Ray &r, const PixelSample &ps, std::vector<PathVertex> &path);
+    int LightSubpath(const PixelSample &ps, std::vector<PathVertex> &path, Colour3 &emitted);
+    int RandomWalk(Ray r, const PixelSample &ps, bool camera, float beta, float pdf, std::vector<PathVertex> &path, int n);
+    Colour3 Connect(const std::vector<PathVertex> &light, int s, const Colour3 &emitted, const std::vector<PathVertex> &camera, int t);
+    void SplatLight(const std::vector<PathVertex> &light, int s, const Colour3 &emitted, const std::vector<PathVertex> &camera, SplatBuffer &splats);
+    float MisWeight(const std::vector<PathVertex> &light, int s, const std::vector<PathVertex> &camera, int t, int emitter) const;
+    float VertexPdf(const PathVertex *prev, const PathVertex &v, const PathVertex &next) const;
+    float EmitterPdf(int light, const Surfel &s) const;
+    float EmissionPdf(int light, const Surfel &s, const PathVertex &next) const;
+    Colour3 Emitted(int light, const Surfel &s, Dir3 w) const;
+    float Reflectance(const Surfel &s, Dir3 a, Dir3 b) const;
+    float CameraImportance(const Point3 &p, int &pixel) const;
+    void RenderAdaptive(std::vector<PixelStats> &stats);
+    void WriteSampleMap(const std::vector<PixelStats> &stats) const;
+    void WriteFeatures() const;
+    void RecordFeatures(uint32_t pixel, const Ray &r, const Surfel *s);
+    void RenderRestir(std::vector<PixelStats> &stats);
+    bool SampleCandidate(const Surfel &s, float u0, float u1, float u2, LightCandidate &c, float &pdf) const;
+    Colour3 CandidateLight(const Surfel &s, Dir3 out, const LightCandidate &c) const;
+    bool Visible(const Surfel &s, const Point3 &target) const;
+    void BuildLights();
+    void EmitPhotons();
+    void TracePhoton(const Light &l, uint32_t seed, uint32_t index, const float power[3], std::vector<Photon> &photons) const;
+    Colour3 CausticLight(Surfel s, Dir3 out) const;
+    Colour3 TraceRay(Ray r, float min, float max, PathState path, const PixelSample &ps);
+    Colour3 Shade(const Ray &r, Surfel &s, PathState path, const PixelSample &ps);
+    bool CachesDiffuse(const PathState &path) const { return IrradianceCaching && path.Specular; };
+    void CachedIrradiance(const Surfel &s, const PixelSample &ps, float irradiance[3]);
     Colour3 DirectLighting(Surfel s, Dir3 out, Light l);
-    Colour3 IndirectLighting(Surfel s, Dir3 out, int curDepth);
+    Colour3 PointLightShading(Surfel s, Dir3 out, const Light &l) const;
+    Colour3 SampleLights(Surfel s, Dir3 out, int depth, const PixelSample &ps, bool cached = false);
+    Colour3 AreaLighting(const Surfel &s, Dir3 out, const LightPoint &lp, int count, bool cached);
+    Colour3 IndirectLighting(Surfel s, Dir3 out, PathState path, const PixelSample &ps);
+    float EmissionWeight(const Ray &r, const Surfel &s, const PathState &path) const;
 
 private:
     ObjectList m_objl;
     Camera m_cam;
     Image m_img;
     std::vector<Light> m_lights;
+    AreaLights m_areaLights;
+    LightBVH m_lightTree; // Point lights first, then area lights
+    AliasTable m_emitters; // The same lights by power, for starting light subpaths
+    PhotonMap m_caustics;
+    SDTree m_guide;
+    Rasterizer m_raster;
+    GBuffer m_gbuffer;
+
+    // The last Incremental image, lights and object bounds, the ids of the objects each pixel
+    // saw in increasing order, and the objects edited and moved since
+    std::vector<PixelStats> m_kept;
+    std::vector<Light> m_keptLights;
+    std::vector<std::pair<Point3, Point3>> m_keptBounds;
+    std::vector<std::vector<int>> m_touched;
+    std::vector<int> m_invalidated;
+    std::vector<int> m_moved;
+    bool m_invalidAll = false;
+
+    std::atomic<bool> m_cancel{false};
+
+    bool m_guided = false;
+    bool m_guideTraining = false;
+
+    // Reservoirs and first hits kept from the last pass for temporal reuse
+    std::vector<Reservoir> m_reservoirs;
+    std::vector<Surfel> m_firstHits;
+    std::vector<bool> m_firstHitValid;
+    uint32_t m_frame = 0;
+
+    // First hit features of each pixel, empty when nothing needs them
+    std::vector<PixelFeatures> m_features;
+
+    // Path statistics
+    std::atomic<unsigned long> m_paths{0};
+    std::atomic<unsigned long> m_segments{0};
 };
 
 Colour3 RayTracer::DirectLighting(Surfel s, Dir3 out, Light l) {
@@ -46,127 +360,1980 @@ Colour3 RayTracer::DirectLighting(Surfel s, Dir3 out, Light l) {
     if (m_objl.DoesRayIntersectSurface(Ray(s.Point+0.0001*s.Normal, in), 0, Unit(in).Length(), s))
         return Colour3(0.0f, 0.0f, 0.0f);
 
-    // Now can normalise the vectors
-    s.Normal = Unit(s.Normal);
-    in = Unit(in);
-    out = Unit(out);
-
     if (l.IsAtInfinity)
         float distance = 1.0f;
 
+    return PointLightShading(s, out, l);
+}
+
+/*
+ * Phong light from a point light at a surface point facing out, leaving visibility to the caller
+ */
+Colour3 RayTracer::PointLightShading(Surfel s, Dir3 out, const Light &l) const {
+    s.Normal = Unit(s.Normal);
+    Dir3 in = Unit(l.Position() - s.Point);
+    out = Unit(out);
+
     Colour3 diffuse = s.Diffuse3(in);
     Colour3 specular = s.Specular3(out, in);
     return (l.Diffuse * diffuse + l.Specular * specular);
 }
 
-Colour3 RayTracer::IndirectLighting(Surfel s, Dir3 out, int curDepth) {
+/*
+ * Build the area lights from the emissive objects, and the light BVH over them and the point lights
+ */
+void RayTracer::BuildLights() {
+    m_areaLights.Build(m_objl);
+
+    std::vector<LightBounds> bounds;
+    for (const auto &l : m_lights) {
+        LightBounds b;
+        b.Lo = l.Position();
+        b.Hi = l.Position();
+        b.Power = 4.0f * MonteCarlo::PI * (Luminance(l.Diffuse) + Luminance(l.Specular));
+        bounds.push_back(b);
+    }
+    for (int i = 0; i < m_areaLights.Count(); ++i)
+        bounds.push_back(m_areaLights.Bounds(i));
+    m_lightTree.Build(bounds);
+
+    std::vector<float> power;
+    for (const auto &b : bounds)
+        power.push_back(b.Power);
+    m_emitters.Build(power);
+}
+
+/*
+ * Direct light at a surface point
+ * Either picks LightSamples lights from the light BVH, or visits every point light and picks one
+ * area light by power. Later samples reuse the light dimensions shifted by the golden ratio
+ */
+Colour3 RayTracer::SampleLights(Surfel s, Dir3 out, int depth, const PixelSample &ps, bool cached) {
+    Colour3 total(0.0f, 0.0f, 0.0f);
+    out = Unit(out);
+    s.FaceForward(out);
+
+    if (!LightTree) {
+        for (const auto &l : m_lights)
+            total += DirectLighting(s, out, l);
+
+        LightPoint lp;
+        if (m_areaLights.Sample(ps.Bounce(depth, SampleDim::LightSelect), ps.Bounce(depth, SampleDim::LightPosition),
+                                ps.Bounce(depth, SampleDim::LightPosition+1), lp))
+            total += AreaLighting(s, out, lp, 1, cached);
+        return total;
+    }
+
+    const int pointLights = m_lights.size();
+    for (int k = 0; k < LightSamples; ++k) {
+        float shift = k * 0.618034f;
+        float u0 = std::fmod(ps.Bounce(depth, SampleDim::LightSelect) + shift, 1.0f);
+        float u1 = std::fmod(ps.Bounce(depth, SampleDim::LightPosition) + shift, 1.0f);
+        float u2 = std::fmod(ps.Bounce(depth, SampleDim::LightPosition+1) + shift, 1.0f);
+
+        float pmf;
+        int light = m_lightTree.Sample(s.Point, s.Normal, u0, pmf);
+        if (light < 0) continue;
+
+        if (light < pointLights) {
+            total += DirectLighting(s, out, m_lights[light]) * (1.0f / (pmf * LightSamples));
+        } else {
+            LightPoint lp;
+            m_areaLights.SamplePoint(light - pointLights, u1, u2, lp);
+            lp.Pdf *= pmf;
+            total += AreaLighting(s, out, lp, LightSamples, cached);
+        }
+    }
+    return total;
+}
+
+/*
+ * Next event estimation towards one point on an emissive object, one of count such samples
+ * Covers only the Blinn-Phong part of the surface, impulse bounces still find lights by hitting them
+ * Weighted against the Blinn-Phong sampling in IndirectLighting with the power heuristic
+ * Expects out and the surfel's normal to be facing forward already
+ */
+Colour3 RayTracer::AreaLighting(const Surfel &s, Dir3 out, const LightPoint &lp, int count, bool cached) {
+    if (s.Impulse >= 1.0f || lp.Pdf <= 0.0f)
+        return Colour3(0.0f, 0.0f, 0.0f);
+
+    Point3 origin = s.Point + 0.0001f * s.Normal;
+    Dir3 toLight = lp.Point - origin;
+    float distance2 = toLight.LengthSquared();
+    Dir3 in = Unit(toLight);
+
+    // Lights emit from both sides, as they do when a path hits them
+    float cosLight = std::abs(Dot(lp.Normal, in));
+    if (cosLight <= 0.0f || Dot(s.Normal, in) <= 0.0f)
+        return Colour3(0.0f, 0.0f, 0.0f);
+
+    // Shadow ray stops just short of the light itself
+    Surfel blocker;
+    if (m_objl.DoesRayIntersectSurface(Ray(origin, toLight), 0, 0.999f, blocker))
+        return Colour3(0.0f, 0.0f, 0.0f);
+
+    // Both densities per unit solid angle, the brdf one scaled by the chance of not taking the impulse
+    float glossy = 1.0f - std::max(s.Impulse, 0.0f);
+    float lightPdf = count * lp.Pdf * distance2 / cosLight;
+    float brdfPdf = glossy * ScatterPdf(s, out, in, cached);
+
+    // Where the irradiance cache takes the Lambert lobe, only the glossy lobe is sampled onwards,
+    // so light sampling alone finds the Lambert lobe's direct light
+    float brdf = s.BRDF(out, in);
+    float shared = cached ? s.BRDF(out, in, true) : brdf;
+    float weight = glossy * (brdf - shared + shared * MonteCarlo::PowerHeuristic(lightPdf, brdfPdf)) / lightPdf;
+    return lp.Emission * weight;
+}
+
+Colour3 RayTracer::IndirectLighting(Surfel s, Dir3 out, PathState path, const PixelSample &ps) {
     // return l.Colour() * s.Ambient;
     // return l.Ambient * s.Ambient;
     Dir3 in;
     float albedo = 0.0f;
+    Colour3 diffuse(0.0f, 0.0f, 0.0f);
+    float scatterPdf = 0.0f;
+
+    // Sample around the normal on the side the ray arrived from
+    out = Unit(out);
+    s.FaceForward(out);
 
     // Decide in direction by impulse refelction
-    if (MonteCarlo::RandomFloat() < s.Impulse) {
+    const int curDepth = path.Depth;
+    path.LastPdf = 0.0f;
+    path.LastPoint = s.Point;
+    path.LastNormal = s.Normal;
+    if (ps.Bounce(curDepth, SampleDim::Impulse) < s.Impulse) {
         // impulse reflection
-        in = 2.0f * s.Normal - out;
+        in = 2.0f * Dot(s.Normal, out) * s.Normal - out;
         albedo = s.ImpulseAlbedo;
     } else {
-        // Use monte carlo to get random vec
-        in = MonteCarlo::RandomVec();
-        albedo = s.BRDF(Unit(out), Unit(in));
+        // With the irradiance cache on, the Lambert lobe takes its light from the cache and
+        // only the glossy lobe is followed
+        const bool cached = CachesDiffuse(path);
+        path.Specular = false;
+        ++path.Scattered;
+        if (cached) {
+            float irradiance[3];
+            CachedIrradiance(s, ps, irradiance);
+            float lambert = s.LambertAlbedo * s.LobeScale() / MonteCarlo::PI;
+            diffuse = Colour3(lambert * irradiance[0], lambert * irradiance[1], lambert * irradiance[2]);
+        }
+
+        // Importance sample the Blinn-Phong lobes, or the guiding tree where it has learned
+        // something, weighting by brdf over the density of both together
+        float pdf;
+        float u0 = ps.Bounce(curDepth, SampleDim::Lobe);
+        float u1 = ps.Bounce(curDepth, SampleDim::Direction), u2 = ps.Bounce(curDepth, SampleDim::Direction+1);
+        const bool guided = m_guided && !cached && m_guide.Guides(s.Point);
+        if (guided && u0 < GuidingFraction) {
+            // The tree covers the whole sphere, folding what falls under the surface back up
+            // keeps every guided sample useful
+            in = m_guide.Sample(s.Point, u1, u2);
+            in = in - 2.0f * std::min(Dot(s.Normal, in), 0.0f) * s.Normal;
+        } else {
+            if (guided) u0 = (u0 - GuidingFraction) / (1.0f - GuidingFraction);
+            in = s.SampleBRDF(out, u0, u1, u2, pdf, cached);
+        }
+        pdf = ScatterPdf(s, out, in, cached);
+        if (pdf <= 0.0f || Dot(s.Normal, in) <= 0.0f)
+            return diffuse;
+        albedo = s.BRDF(out, in, cached) / pdf;
+        scatterPdf = pdf;
+        path.LastPdf = (1.0f - std::max(s.Impulse, 0.0f)) * pdf;
+    }
+
+    // Russian roulette once the path is deep enough. Continue with probability equal to the
+    // throughput, up to MaxSurvival, and divide survivors by that probability to keep the
+    // estimate unbiased
+    path.Throughput *= albedo;
+    float survival = 1.0f;
+    if (curDepth + 1 >= MinDepth) {
+        survival = std::min(path.Throughput, MaxSurvival);
+        if (survival <= 0.0f || ps.Bounce(curDepth, SampleDim::Roulette) >= survival)
+            return diffuse;
     }
 
     // Find incoming light
-    Colour3 inLight = TraceRay(Ray(s.Point, in), 0, infinity, curDepth-1);
+    path.Depth = curDepth + 1;
+    path.Throughput /= survival;
+    Colour3 inLight = TraceRay(Ray(s.Point + 0.0001f * s.Normal, in), 0, infinity, path, ps);
+
+    // Teach the guiding tree how much light this direction brought through the brdf, over the
+    // chance of taking it, so it learns the product the estimate is made of
+    if (m_guideTraining && scatterPdf > 0.0f)
+        m_guide.Record(s.Point, in, Luminance(inLight) * s.BRDF(out, in) / scatterPdf);
 
     // Apply brdf
-    return inLight * albedo;
+    return diffuse + inLight * (albedo / survival);
 }
 
-Colour3 RayTracer::TraceRay(Ray r, float min, float max, int depth) {
+Colour3 RayTracer::TraceRay(Ray r, float min, float max, PathState path, const PixelSample &ps) {
 
     // Start with no light
     Colour3 totalRadiance(0.0f, 0.0f, 0.0f);
 
-    if (depth <= 0)
+    if (path.Depth >= MaxDepth)
         return totalRadiance;
+    ++m_segments;
 
     // Find intersection point from ray into the world
     Surfel s;
-    if (m_objl.DoesRayIntersectSurface(r, min, max, s)) {
+    bool hit = m_objl.DoesRayIntersectSurface(r, min, max, s);
+    if (path.Depth == 0)
+        RecordFeatures(ps.Pixel(), r, hit ? &s : nullptr);
+    if (hit && path.Scattered < TrackDepth && !m_touched.empty())
+        Touch(ps.Pixel(), s.ObjectId);
+    if (hit) {
         // The ray intersects a surface
-        
-        // Add the emissive colour of the surface
-        totalRadiance += s.Emission;
+        totalRadiance = Shade(r, s, path, ps);
+    }
+
+    // Return collected light
+    return totalRadiance;
+}
+
+/*
+ * Light leaving surfel s back along the ray r that found it
+ */
+Colour3 RayTracer::Shade(const Ray &r, Surfel &s, PathState path, const PixelSample &ps) {
+    // Add the emissive colour of the surface
+    Colour3 totalRadiance = s.Emission * EmissionWeight(r, s, path);
+
+    // Gather direct light, and light from the point lights through mirrors
+    totalRadiance += SampleLights(s, -r.Direction(), path.Depth, ps, CachesDiffuse(path));
+    totalRadiance += CausticLight(s, -r.Direction());
+
+    path.LightsResampled = false;
+    totalRadiance += IndirectLighting(s, -r.Direction(), path, ps);
+    return totalRadiance;
+}
+
+/*
+ * Indirect irradiance at a surfel facing forward, from the cache or from a new record
+ * A new record traces a stratified cosine weighted hemisphere of about CacheRays paths. Their
+ * first hits take no emission, as light sampling at the surfel already has all direct light
+ */
+void RayTracer::CachedIrradiance(const Surfel &s, const PixelSample &ps, float irradiance[3]) {
+    if (Cache.Lookup(s.Point, s.Normal, irradiance))
+        return;
+
+    // About pi times as many azimuthal strata as polar ones
+    const int M = std::max(2, int(std::lround(std::sqrt(CacheRays / MonteCarlo::PI))));
+    const int N = std::max(3, CacheRays / M);
+    const uint32_t seed = MonteCarlo::HashCombine(uint32_t(ps.Pixel() ^ (ps.Pixel() >> 32)), ps.Index());
+    std::vector<Colour3> radiance(M * N);
+    std::vector<float> distance(M * N);
+
+    Dir3 t, b;
+    MonteCarlo::OrthonormalBasis(s.Normal, t, b);
+    Point3 origin = s.Point + 0.0001f * s.Normal;
+    for (int j = 0; j < M; ++j) {
+        for (int k = 0; k < N; ++k) {
+            PixelSample rs(*PathSampler, seed, j * N + k);
+            float u = (j + rs.Get(SampleDim::PixelX)) / M;
+            float phi = 2.0f * MonteCarlo::PI * (k + rs.Get(SampleDim::PixelY)) / N;
+            float cosTheta = std::sqrt(std::max(0.0f, 1.0f - u));
+            Dir3 in = std::sqrt(u) * (std::cos(phi) * t + std::sin(phi) * b) + cosTheta * s.Normal;
+
+            ++m_segments;
+            Ray ray(origin, in);
+            Surfel hit;
+            if (!m_objl.DoesRayIntersectSurface(ray, 0, infinity, hit)) {
+                radiance[j * N + k] = Colour3(0.0f, 0.0f, 0.0f);
+                distance[j * N + k] = infinity;
+                continue;
+            }
+
+            PathState path;
+            path.Depth = 1;
+            path.LastPdf = cosTheta / MonteCarlo::PI;
+            path.LastPoint = s.Point;
+            path.LastNormal = s.Normal;
+            path.LightsResampled = true;
+            path.Specular = false;
+            radiance[j * N + k] = Shade(ray, hit, path, rs);
+            distance[j * N + k] = hit.At * in.Length();
+        }
+    }
+
+    IrradianceRecord record = Cache.Record(s.Point, s.Normal, M, N, radiance, distance);
+    Cache.Insert(record);
+    for (int c = 0; c < 3; ++c)
+        irradiance[c] = record.Irradiance[c];
+}
+
+/*
+ * Fill the caustic map from the point lights, tracing photons in parallel
+ * Photons are traced in fixed chunks and gathered in chunk order, so the map does not depend on
+ * the number of threads
+ */
+void RayTracer::EmitPhotons() {
+    m_caustics.Clear();
+    if (!Caustics || CausticPhotons <= 0) return;
 
-        // Loop each light source
-        for (unsigned int i = 0; i < m_lights.size(); ++i) {
-            // Gather Direct light
-            totalRadiance += DirectLighting(s, -r.Direction(), m_lights[i]);
+    // Point lights shine their Diffuse colour as intensity in every direction, as the light BVH
+    // assumes, so each has 4 pi Diffuse of power
+    auto power = [](const Light &l) { return 4.0f * MonteCarlo::PI * Luminance(l.Diffuse); };
+    float total = 0.0f;
+    for (const auto &l : m_lights) total += power(l);
+    if (total <= 0.0f) return;
+
+    std::vector<Photon> photons;
+    for (uint32_t i = 0; i < m_lights.size(); ++i) {
+        const Light &l = m_lights[i];
+        int count = int(CausticPhotons * power(l) / total);
+        if (count <= 0) continue;
+
+        // Each photon carries an equal share of the light's power
+        const float share = 4.0f * MonteCarlo::PI / count;
+        const float flux[3] = {l.Diffuse.r() * share, l.Diffuse.g() * share, l.Diffuse.b() * share};
+        const uint32_t seed = MonteCarlo::HashCombine(0x70686f74u, i);
+        const int chunk = 4096;
+        std::vector<std::vector<Photon>> kept((count + chunk - 1) / chunk);
+        Parallel::For(count, chunk, Threads, [&](int begin, int end) {
+            for (int n = begin; n < end; ++n)
+                TracePhoton(l, seed, n, flux, kept[begin / chunk]);
+        });
+        for (const auto &k : kept)
+            photons.insert(photons.end(), k.begin(), k.end());
+    }
+    m_caustics.Build(std::move(photons));
+}
+
+/*
+ * Follow one photon from a point light through impulse reflections
+ * Each hit takes the impulse with the surface's Impulse chance as camera paths do. The photon is
+ * kept where it stops at a surface after at least one impulse; light straight from the lights
+ * is left to light sampling. PointLightShading lights a surface with no falloff, as if the
+ * irradiance were the light's Diffuse times the cosine at any distance, so the kept photon is
+ * scaled by the squared length of its path, the distance to the light's image in the mirrors,
+ * and by the chance it had of stopping, which light sampling does not pay
+ */
+void RayTracer::TracePhoton(const Light &l, uint32_t seed, uint32_t index, const float power[3], std::vector<Photon> &photons) const {
+    PixelSample ps(*PathSampler, seed, index);
+
+    // Uniform over the sphere
+    float z = 1.0f - 2.0f * ps.Get(SampleDim::PixelX);
+    float phi = 2.0f * MonteCarlo::PI * ps.Get(SampleDim::PixelY);
+    float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+    Ray ray(l.Position(), Dir3(r * std::cos(phi), r * std::sin(phi), z));
+
+    Photon photon;
+    std::copy(power, power + 3, photon.Power);
+    float travelled = 0.0f;
+    for (int depth = 0; depth < MaxDepth; ++depth) {
+        Surfel s;
+        if (!m_objl.DoesRayIntersectSurface(ray, 0, infinity, s))
+            return;
+        Dir3 in = Unit(-ray.Direction());
+        s.FaceForward(in);
+        travelled += (s.Point - ray.Origin()).Length();
+
+        if (ps.Bounce(depth, SampleDim::Impulse) >= s.Impulse) {
+            if (depth > 0) {
+                float scale = travelled * travelled / (1.0f - std::max(s.Impulse, 0.0f));
+                photon.Position = s.Point;
+                photon.In = in;
+                for (auto &p : photon.Power) p *= scale;
+                photons.push_back(photon);
+            }
+            return;
         }
 
-        totalRadiance += IndirectLighting(s, -r.Direction(), depth);
+        for (auto &p : photon.Power) p *= s.ImpulseAlbedo;
+        ray = Ray(s.Point + 0.0001f * s.Normal, 2.0f * Dot(s.Normal, in) * s.Normal - in);
     }
+}
 
-    // Return collected light
-    return totalRadiance;
+/*
+ * Caustic light leaving s towards out, estimated from the density of nearby photons
+ * Photons off the surface's tangent plane, or arriving from behind it, are skipped so light does
+ * not leak round corners. Their density stands for the Diffuse of a light at the cosine, so
+ * they are shaded as the diffuse term of PointLightShading; the highlight is left out, as the
+ * photons do not carry the light's Specular
+ */
+Colour3 RayTracer::CausticLight(Surfel s, Dir3 out) const {
+    if (m_caustics.Empty())
+        return Colour3(0.0f, 0.0f, 0.0f);
+    out = Unit(out);
+    s.FaceForward(out);
+    if (s.Impulse >= 1.0f)
+        return Colour3(0.0f, 0.0f, 0.0f);
+
+    std::vector<const Photon*> found;
+    float radius2 = m_caustics.Nearest(s.Point, CausticNeighbours, CausticRadius, found);
+    float thickness = 0.1f * std::sqrt(radius2);
+
+    float sum[3] = {0.0f, 0.0f, 0.0f};
+    for (const Photon *p : found) {
+        float cosIn = Dot(s.Normal, p->In);
+        if (cosIn <= 0.0f || std::abs(Dot(p->Position - s.Point, s.Normal)) > thickness)
+            continue;
+        for (int c = 0; c < 3; ++c)
+            sum[c] += p->Power[c];
+    }
+
+    // Diffuse3 includes the cosine, which the photon density already accounts for
+    float scale = 1.0f / (MonteCarlo::PI * radius2);
+    return Colour3(sum[0] * scale, sum[1] * scale, sum[2] * scale) * s.Diffuse;
 }
 
-int RayTracer::Exec() {
-    // Init with one light only
+/*
+ * Weight for emission found by a ray that the previous vertex's Blinn-Phong sampling chose
+ * Camera rays and impulse bounces have no such density, light sampling cannot produce them, so
+ * they keep all of it
+ */
+float RayTracer::EmissionWeight(const Ray &r, const Surfel &s, const PathState &path) const {
+    if (path.LastPdf <= 0.0f) return 1.0f;
+    if (path.LightsResampled) return 0.0f;
+
+    // Density with which SampleLights would have picked this point, per unit area
+    int light = m_areaLights.LightOf(s.ObjectId);
+    if (light < 0) return 1.0f;
+    float areaPdf;
+    if (LightTree)
+        areaPdf = LightSamples * m_lightTree.Pmf(path.LastPoint, path.LastNormal, m_lights.size() + light) / m_areaLights.Area(light);
+    else
+        areaPdf = m_areaLights.Pdf(s.ObjectId);
+    if (areaPdf <= 0.0f) return 1.0f;
+
+    Dir3 d = r.Direction();
+    float distance = s.At * d.Length();
+    float cosLight = std::abs(Dot(Unit(s.Normal), Unit(d)));
+    if (cosLight <= 0.0f) return 0.0f;
+    return MonteCarlo::PowerHeuristic(path.LastPdf, areaPdf * distance * distance / cosLight);
+}
+
+/*
+ * Trace the next sample of a pixel and add it to the pixel's statistics
+ * Pixels are numbered top row first, as they are written out
+ */
+void RayTracer::SamplePixel(uint64_t pixel, PixelStats &stats, uint32_t first) {
+    const int width = m_img.Width();
+    int i = int(pixel % width);
+    int j = m_img.Height() - 1 - int(pixel / width);
+
+    PixelSample ps(*PathSampler, pixel, first + stats.Count());
+    float u = float(i + ps.Get(SampleDim::PixelX)) / (m_img.Width()-1);
+    float v = float(j + ps.Get(SampleDim::PixelY)) / (m_img.Height()-1);
+    stats.Add(TraceRay(m_cam.CameraRay(u, v), -infinity, infinity, PathState(), ps));
+    ++m_paths;
+}
+
+/*
+ * The plain sample loop with first hits from the visibility buffer, a tile at a time per thread
+ * Every sample keeps the jitter SamplePixel would give it, so the image is the traced one
+ */
+void RayTracer::RenderRasterized(std::vector<PixelStats> &stats) {
+    const int width = m_img.Width(), height = m_img.Height();
+    const int samples = m_img.NumberOfSamples();
+
+    Parallel::For(m_raster.Tiles(), 1, Threads, [&](int begin, int end) {
+        std::vector<float> us, vs;
+        std::vector<int> ids;
+        for (int tile = begin; tile < end; ++tile) {
+            int x0, y0, x1, y1;
+            m_raster.TileBounds(tile, x0, y0, x1, y1);
+            us.clear();
+            vs.clear();
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                    for (int n = 0; n < samples; ++n) {
+                        PixelSample ps(*PathSampler, y * width + x, n);
+                        us.push_back(float(x + ps.Get(SampleDim::PixelX)) / (width-1));
+                        vs.push_back(float(height - 1 - y + ps.Get(SampleDim::PixelY)) / (height-1));
+                    }
+            ids.resize(us.size());
+            m_raster.Resolve(tile, samples, us.data(), vs.data(), ids.data());
+
+            int k = 0;
+            for (int y = y0; y < y1; ++y)
+                for (int x = x0; x < x1; ++x)
+                    for (int n = 0; n < samples; ++n, ++k) {
+                        PixelSample ps(*PathSampler, y * width + x, n);
+                        stats[y * width + x].Add(ShadeFirstHit(m_cam.CameraRay(us[k], vs[k]), ids[k], ps));
+                        ++m_paths;
+                    }
+        }
+    });
+}
+
+/*
+ * What TraceRay gives a camera ray, knowing the object it first hits
+ * Only that object is intersected. A ray that misses it went through the tessellation just
+ * outside a curved silhouette, and is traced through the whole scene instead. A mesh enclosing
+ * a curved object also hides whatever lies between it and the surface, so a hit on such an
+ * object is checked against the whole scene up to where it was found
+ */
+Colour3 RayTracer::ShadeFirstHit(const Ray &r, int object, const PixelSample &ps) {
+    Surfel s;
+    if (object >= 0 && !m_objl.objects[object]->Intersects(r, -infinity, infinity, s))
+        return TraceRay(r, -infinity, infinity, PathState(), ps);
+
+    if (object >= 0 && !m_objl.objects[object]->TessellationIsExact() &&
+        m_objl.DoesRayIntersectSurface(r, -infinity, s.At, s))
+        return ShadeCameraHit(r, &s, ps);
+
+    s.ObjectId = object;
+    if (object >= 0)
+        m_objl.ResolveMaterial(s);
+    return ShadeCameraHit(r, object >= 0 ? &s : nullptr, ps);
+}
+
+/*
+ * What TraceRay gives a camera ray whose first hit is already known, none when s is null
+ */
+Colour3 RayTracer::ShadeCameraHit(const Ray &r, Surfel *s, const PixelSample &ps) {
+    ++m_segments;
+    RecordFeatures(ps.Pixel(), r, s);
+    if (!s)
+        return Colour3(0.0f, 0.0f, 0.0f);
+    return Shade(r, *s, PathState(), ps);
+}
+
+void RayTracer::Invalidate(int object, bool moved) {
+    // Light from an emissive object reaches pixels that never saw it
+    if (m_areaLights.LightOf(object) >= 0)
+        m_invalidAll = true;
+    // Cached first hits no longer hold once geometry changes
+    if (moved) {
+        m_moved.push_back(object);
+        m_gbuffer.Reset(0, 0, nullptr);
+    }
+    m_invalidated.push_back(object);
+}
+
+/*
+ * Note that a path of pixel hit object. Only the thread rendering the pixel touches its list
+ */
+void RayTracer::Touch(int pixel, int object) {
+    std::vector<int> &seen = m_touched[pixel];
+    auto at = std::lower_bound(seen.begin(), seen.end(), object);
+    if (at == seen.end() || *at != object)
+        seen.insert(at, object);
+}
+
+/*
+ * Mark the pixels whose camera samples can fall inside the box from lo to hi
+ * Returns false when part of the box is behind the camera, where it has no bounds on screen
+ */
+bool RayTracer::CoverOnScreen(const Point3 &lo, const Point3 &hi, std::vector<char> &covered) const {
+    const int width = m_img.Width(), height = m_img.Height();
+    float u0 = infinity, v0 = infinity, u1 = -infinity, v1 = -infinity;
+    for (int corner = 0; corner < 8; ++corner) {
+        Point3 p((corner & 1) ? hi.x() : lo.x(), (corner & 2) ? hi.y() : lo.y(), (corner & 4) ? hi.z() : lo.z());
+        float u, v, solidAngle;
+        if (!m_cam.Project(p, u, v, solidAngle))
+            return false;
+        u0 = std::min(u0, u); u1 = std::max(u1, u);
+        v0 = std::min(v0, v); v1 = std::max(v1, v);
+    }
+
+    // Samples of pixel column i have u in [i, i + 1] / (width - 1), and of row j from the bottom
+    // v likewise. One pixel more on each side keeps rounding on the safe side
+    int i0 = std::max(int(std::floor(u0 * (width - 1))) - 1, 0);
+    int i1 = std::min(int(std::floor(u1 * (width - 1))) + 1, width - 1);
+    int j0 = std::max(int(std::floor(v0 * (height - 1))) - 1, 0);
+    int j1 = std::min(int(std::floor(v1 * (height - 1))) + 1, height - 1);
+    for (int j = j0; j <= j1; ++j)
+        for (int i = i0; i <= i1; ++i)
+            covered[(height - 1 - j) * width + i] = 1;
+    return true;
+}
+
+void RayTracer::InvalidateMaterial(uint16_t material) {
+    for (int i = 0; i < int(m_objl.objects.size()); ++i)
+        if (m_objl.objects[i]->MaterialId == material)
+            Invalidate(i);
+}
+
+/*
+ * The plain sample loop over only the pixels that saw an invalidated object, or that a moved
+ * object covers on screen, the rest kept from the last Incremental Exec. All pixels are rendered
+ * when there is nothing to keep, the lights changed, an edited object emits light or a moved one
+ * reaches behind the camera
+ */
+void RayTracer::RenderIncremental(std::vector<PixelStats> &stats) {
+    const int objects = m_objl.objects.size();
+    std::vector<char> changed(objects, 0);
+    bool all = m_invalidAll || m_kept.size() != stats.size() || !(m_lights == m_keptLights) ||
+               int(m_keptBounds.size()) != objects;
+    for (int object : m_invalidated) {
+        changed[object] = 1;
+        all = all || Luminance(m_objl.MaterialOf(object).Emission) > 0.0f;
+    }
+
+    // Where a moved object was and is now, on screen
+    std::vector<char> covered(stats.size(), 0);
+    for (int object : m_moved) {
+        if (all) break;
+        Point3 lo, hi;
+        m_objl.objects[object]->Bounds(lo, hi);
+        all = !CoverOnScreen(m_keptBounds[object].first, m_keptBounds[object].second, covered) ||
+              !CoverOnScreen(lo, hi, covered);
+    }
+
+    if (all) {
+        m_touched.assign(stats.size(), std::vector<int>());
+        m_features.assign(m_features.size(), PixelFeatures());
+    }
+
+    std::vector<int> pixels;
+    for (int p = 0; p < int(stats.size()); ++p) {
+        bool saw = covered[p];
+        for (int object : m_touched[p])
+            saw = saw || changed[object];
+        if (all || saw) {
+            pixels.push_back(p);
+            m_touched[p].clear();
+            if (!m_features.empty())
+                m_features[p] = PixelFeatures();
+        } else {
+            stats[p] = m_kept[p];
+        }
+    }
+
+    Parallel::For(pixels.size(), m_img.Width(), Threads, [&](int begin, int end) {
+        for (int k = begin; k < end; ++k)
+            for (int n = 0; n < m_img.NumberOfSamples(); ++n)
+                SamplePixel(pixels[k], stats[pixels[k]]);
+    });
+    std::cerr << "Pixels rendered: " << pixels.size() << " of " << stats.size() << std::endl;
+
+    m_kept = stats;
+    m_keptLights = m_lights;
+    m_keptBounds.resize(objects);
+    for (int object = 0; object < objects; ++object)
+        m_objl.objects[object]->Bounds(m_keptBounds[object].first, m_keptBounds[object].second);
+    m_invalidated.clear();
+    m_moved.clear();
+    m_invalidAll = false;
+}
+
+/*
+ * Hash of the objects, materials, lights and camera, telling scenes apart for checkpoints
+ * Objects are told by their bounds, area, normal cone, a sampled point and material id
+ */
+uint32_t RayTracer::SceneFingerprint() const {
+    uint32_t h = 0;
+    auto add = [&h](float f) {
+        uint32_t bits;
+        std::memcpy(&bits, &f, sizeof(bits));
+        h = MonteCarlo::HashCombine(h, bits);
+    };
+    auto addVec = [&add](const Vec3 &v) { add(v.x()); add(v.y()); add(v.z()); };
+    auto addColour = [&add](const Colour3 &c) { add(c.r()); add(c.g()); add(c.b()); };
+
+    for (const auto &object : m_objl.objects) {
+        Point3 lo, hi;
+        Dir3 axis, n;
+        object->Bounds(lo, hi);
+        addVec(lo);
+        addVec(hi);
+        add(object->Area());
+        add(object->NormalCone(axis));
+        addVec(axis);
+        addVec(object->SamplePoint(0.25f, 0.75f, n));
+        addVec(n);
+        h = MonteCarlo::HashCombine(h, object->MaterialId);
+    }
+    for (size_t id = 0; id < m_objl.materials.Size(); ++id) {
+        const Material &m = m_objl.materials[id];
+        addColour(m.Emission);
+        for (float f : {m.AmbientAlbedo, m.LambertAlbedo, m.GlossyAlbedo, m.Exponent, m.Impulse, m.ImpulseAlbedo})
+            add(f);
+        addColour(m.Ambient);
+        addColour(m.Diffuse);
+        addColour(m.Specular);
+    }
+    for (const auto &l : m_lights) {
+        addVec(l.Position());
+        addColour(l.Colour());
+        addColour(l.Ambient);
+        addColour(l.Diffuse);
+        addColour(l.Specular);
+        add(l.IsAtInfinity ? 1.0f : 0.0f);
+        add(l.Power);
+    }
+    addVec(m_cam.Position());
+    for (float u : {0.0f, 1.0f})
+        for (float v : {0.0f, 1.0f})
+            addVec(m_cam.CameraRay(u, v).Direction());
+    return h;
+}
+
+/*
+ * Open the checkpoint file for this image and scene, taking the pixels from it with Resume on
+ * Returns false when there is no file to save to, after saying so
+ */
+bool RayTracer::OpenCheckpoint(Checkpoint &file, std::vector<PixelStats> &stats) const {
+    if (!file.Open(CheckpointPath, m_img.Width(), m_img.Height(), m_img.NumberOfSamples(), PathSampler->Fingerprint(), SceneFingerprint())) {
+        std::cerr << "Cannot open checkpoint " << CheckpointPath << ", rendering without" << std::endl;
+        return false;
+    }
+    if (Resume) {
+        if (file.HasSave())
+            file.Load(stats);
+        else
+            std::cerr << "No checkpoint of this image and scene to resume, starting over" << std::endl;
+    }
+    return true;
+}
+
+/*
+ * The plain sample loop in passes over the whole image, saving to the checkpoint file between
+ * passes every CheckpointInterval seconds and once at the end
+ */
+void RayTracer::RenderCheckpointed(std::vector<PixelStats> &stats) {
+    const int samples = m_img.NumberOfSamples();
+    Checkpoint file;
+    OpenCheckpoint(file, stats);
+
+    auto saved = std::chrono::steady_clock::now();
+    for (int pass = 0; pass < samples; pass += std::max(PassSamples, 1)) {
+        const int target = std::min(samples, pass + std::max(PassSamples, 1));
+        Parallel::For(stats.size(), m_img.Width(), Threads, [&](int begin, int end) {
+            for (int p = begin; p < end; ++p)
+                while (stats[p].Count() < target)
+                    SamplePixel(p, stats[p]);
+        });
+
+        auto now = std::chrono::steady_clock::now();
+        if (target == samples || std::chrono::duration<float>(now - saved).count() >= CheckpointInterval) {
+            file.Save(stats);
+            saved = now;
+        }
+    }
+}
+
+/*
+ * The plain sample loop in passes of doubling samples per pixel, until all NumberOfSamples are
+ * taken or a budget runs out or Cancel is called. Each thread checks before every pixel, so
+ * stopping waits for no more than a pixel's samples. With CheckpointPath set, passes save as
+ * RenderCheckpointed's do and the last one always saves, however far it got
+ */
+void RayTracer::RenderProgressive(std::vector<PixelStats> &stats) {
+    const auto start = std::chrono::steady_clock::now();
+    const int samples = m_img.NumberOfSamples();
+    Checkpoint file;
+    const bool checkpointed = !CheckpointPath.empty() && OpenCheckpoint(file, stats);
+    auto saved = start;
+    std::atomic<bool> stopped(false);
+    auto over = [&]() {
+        if (m_cancel || (RayBudget > 0 && m_segments >= RayBudget))
+            return true;
+        std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+        return TimeBudget > 0.0f && elapsed.count() >= TimeBudget;
+    };
+
+    AsyncWriter writer(2);
+    int passes = 0, target = 0;
+    while (!stopped && target < samples) {
+        target = std::min(samples, std::max(1, 2 * target));
+        Parallel::For(stats.size(), m_img.Width(), Threads, [&](int begin, int end) {
+            for (int p = begin; p < end && !stopped; ++p) {
+                if (over()) {
+                    stopped = true;
+                    break;
+                }
+                while (stats[p].Count() < target)
+                    SamplePixel(p, stats[p]);
+            }
+        });
+        WriteProgress(stats, writer);
+        ++passes;
+
+        auto now = std::chrono::steady_clock::now();
+        if (checkpointed && (stopped || target == samples || std::chrono::duration<float>(now - saved).count() >= CheckpointInterval)) {
+            file.Save(stats);
+            saved = now;
+        }
+    }
+    std::cerr << "Passes: " << passes << (stopped ? ", stopped in the last" : "") << std::endl;
+}
+
+/*
+ * Write the mean of every pixel so far, through a temporary file so readers never see half an
+ * image. The means are taken at once and the writer encodes and writes them while the next pass
+ * renders
+ */
+void RayTracer::WriteProgress(const std::vector<PixelStats> &stats, AsyncWriter &writer) const {
+    auto frame = std::make_shared<Framebuffer>(m_img.Width(), m_img.Height());
+    for (size_t p = 0; p < stats.size(); ++p)
+        frame->Set(p, stats[p].Mean());
+
+    writer.Post([this, frame]() {
+        const std::string temp = ProgressPath + ".tmp";
+        if (WriteImage(*frame, temp, ImageFile::FromPath(ProgressPath)))
+            std::rename(temp.c_str(), ProgressPath.c_str());
+    });
+}
+
+/*
+ * The plain sample loop, a row of pixels at a time per thread
+ * A P3 or P6 image that is not denoised needs nothing of the whole image, so each finished row
+ * goes to a writer thread, which converts and writes the rows in order while the rest render.
+ * wrote tells whether the image was written here; returns false when writing it failed
+ */
+bool RayTracer::RenderPlain(std::vector<PixelStats> &stats, bool &wrote) {
+    const int width = m_img.Width(), height = m_img.Height();
+    wrote = false;
+    std::FILE *out = nullptr;
+    if (!Denoise && (OutputFormat == ImageFormat::P3 || OutputFormat == ImageFormat::P6))
+        out = OutputPath.empty() ? stdout : std::fopen(OutputPath.c_str(), "wb");
+
+    if (!out) {
+        Parallel::For(stats.size(), width, Threads, [&](int begin, int end) {
+            for (int p = begin; p < end; ++p)
+                for (int n = 0; n < m_img.NumberOfSamples(); ++n)
+                    SamplePixel(p, stats[p]);
+        });
+        return true;
+    }
+
+    // Only the writer touches these, one job at a time
+    std::vector<bool> done(height, false);
+    int next = 0;
+    const std::string header = ImageFile::Header(OutputFormat, width, height);
+    bool ok = std::fwrite(header.data(), 1, header.size(), out) == header.size();
+
+    AsyncWriter writer(4 * Parallel::DefaultThreads());
+    Parallel::For(stats.size(), width, Threads, [&](int begin, int end) {
+        for (int p = begin; p < end; ++p)
+            for (int n = 0; n < m_img.NumberOfSamples(); ++n)
+                SamplePixel(p, stats[p]);
+
+        const int row = begin / width;
+        writer.Post([&, row]() {
+            done[row] = true;
+            std::string rows;
+            for (; next < height && done[next]; ++next) {
+                Framebuffer line(width, 1);
+                for (int x = 0; x < width; ++x)
+                    line.Set(x, stats[next * width + x].Mean());
+                ImageFile::AppendPixels(rows, line.Data(), 3 * size_t(width), OutputFormat, Display);
+            }
+            ok = std::fwrite(rows.data(), 1, rows.size(), out) == rows.size() && ok;
+        });
+    });
+    writer.Finish();
+
+    wrote = true;
+    ok = (out == stdout ? std::fflush(out) : std::fclose(out)) == 0 && ok;
+    if (!ok)
+        std::cerr << "Could not write " << (OutputPath.empty() ? "the image" : OutputPath) << std::endl;
+    return ok;
+}
+
+/*
+ * The plain sample loop a tile at a time, each tile written out and dropped once its pixels are
+ * done. Only the tiles being rendered or waiting for the writer are held, not the image
+ */
+bool RayTracer::RenderStreamed() {
+    const int width = m_img.Width(), height = m_img.Height();
+    const int samples = m_img.NumberOfSamples();
+    m_features.clear();
+
+    TiledTiff file;
+    if (!file.Open(StreamPath, width, height, StreamTileSize)) {
+        std::cerr << "Could not write " << StreamPath << std::endl;
+        return false;
+    }
+    const int size = file.TileSize();
+    if (file.Tiles() > uint32_t(std::numeric_limits<int>::max())) {
+        std::cerr << "Too many tiles in " << StreamPath << ", use larger ones" << std::endl;
+        return false;
+    }
+
+    // Finished tiles are converted and written by the writer thread, with only so many waiting
+    AsyncWriter writer(4 * Parallel::DefaultThreads());
+    std::vector<uint8_t> bytes(3 * size_t(size) * size);
+    Parallel::For(file.Tiles(), 1, Threads, [&](int begin, int end) {
+        for (int tile = begin; tile < end; ++tile) {
+            auto frame = std::make_shared<Framebuffer>(size, size);
+            uint32_t x0, y0, x1, y1;
+            file.TileBounds(tile, x0, y0, x1, y1);
+            for (uint32_t y = y0; y < y1; ++y)
+                for (uint32_t x = x0; x < x1; ++x) {
+                    PixelStats stats;
+                    for (int n = 0; n < samples; ++n)
+                        SamplePixel(uint64_t(y) * width + x, stats);
+                    frame->Set((y - y0) * size + (x - x0), stats.Mean());
+                }
+            writer.Post([&, tile, frame]() {
+                Display.Convert(frame->Data(), bytes.size(), bytes.data());
+                file.WriteTile(tile, bytes.data());
+            });
+        }
+    });
+    writer.Finish();
+
+    if (m_paths > 0)
+        std::cerr << "Average path length: " << float(m_segments) / m_paths << std::endl;
+    if (!file.Close()) {
+        std::cerr << "Could not write " << StreamPath << std::endl;
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Cast every camera sample of the image once and keep where it landed
+ */
+void RayTracer::FillFirstHits() {
+    const int width = m_img.Width(), height = m_img.Height();
+    const int samples = m_img.NumberOfSamples();
+    m_gbuffer.Reset(width * height, samples, PathSampler.get());
+
+    Parallel::For(width * height, width, Threads, [&](int begin, int end) {
+        for (int p = begin; p < end; ++p) {
+            int i = p % width;
+            int j = height - 1 - p / width;
+            for (int n = 0; n < samples; ++n) {
+                PixelSample ps(*PathSampler, p, n);
+                FirstHit &hit = m_gbuffer.Hit(p, n);
+                hit.U = float(i + ps.Get(SampleDim::PixelX)) / (width-1);
+                hit.V = float(j + ps.Get(SampleDim::PixelY)) / (height-1);
+
+                Surfel s;
+                if (m_objl.DoesRayIntersectSurface(m_cam.CameraRay(hit.U, hit.V), -infinity, infinity, s)) {
+                    hit.At = s.At;
+                    hit.Normal = s.Normal;
+                    hit.ObjectId = s.ObjectId;
+                }
+            }
+        }
+    });
+    std::cerr << "First hits cached: " << m_gbuffer.Bytes() / (1024 * 1024) << " MB" << std::endl;
+}
+
+/*
+ * The plain sample loop shading from the cached first hits, filling them first if the image or
+ * sampler changed. The surfel is rebuilt as the object's Intersects builds it, with the material
+ * the object has now, so the image is the one casting would give
+ */
+void RayTracer::RenderCached(std::vector<PixelStats> &stats) {
+    const int samples = m_img.NumberOfSamples();
+    if (!m_gbuffer.Matches(stats.size(), samples, PathSampler.get()))
+        FillFirstHits();
+
+    Parallel::For(stats.size(), m_img.Width(), Threads, [&](int begin, int end) {
+        for (int p = begin; p < end; ++p) {
+            for (int n = 0; n < samples; ++n) {
+                const FirstHit &hit = m_gbuffer.Hit(p, n);
+                PixelSample ps(*PathSampler, p, n);
+                Ray r = m_cam.CameraRay(hit.U, hit.V);
+                Surfel s;
+                if (hit.ObjectId >= 0) {
+                    s.At = hit.At;
+                    s.Point = r.At(hit.At);
+                    s.Normal = hit.Normal;
+                    s.ObjectId = hit.ObjectId;
+                    s.MaterialId = m_objl.objects[hit.ObjectId]->MaterialId;
+                    m_objl.ResolveMaterial(s);
+                }
+                stats[p].Add(ShadeCameraHit(r, hit.ObjectId >= 0 ? &s : nullptr, ps));
+                ++m_paths;
+            }
+        }
+    });
+}
+
+/*
+ * Density of IndirectLighting choosing in, per unit solid angle, before the impulse chance
+ * The BRDF's own density, mixed with the guiding tree's where the tree is in use. A guided
+ * direction above the surface may have been sampled as itself or as its mirror image below
+ */
+float RayTracer::ScatterPdf(const Surfel &s, Dir3 out, Dir3 in, bool cached) const {
+    float pdf = s.PDF(out, in, cached);
+    if (m_guided && !cached && m_guide.Guides(s.Point)) {
+        Dir3 mirror = in - 2.0f * Dot(s.Normal, in) * s.Normal;
+        float guide = m_guide.Pdf(s.Point, in) + m_guide.Pdf(s.Point, mirror);
+        pdf = GuidingFraction * guide + (1.0f - GuidingFraction) * pdf;
+    }
+    return pdf;
+}
+
+/*
+ * Progressive path guiding (Muller et al. 2017). Iterations of 1, 2, 4... samples per pixel
+ * train the SD-tree, each sampling with what the ones before learned, for as long as the next
+ * one would still leave it the larger share of the budget. The last iteration spends the rest
+ * without recording. Every iteration is an unbiased image of its own, so they are blended by
+ * inverse variance, which lets the later ones dominate without wasting the early samples
+ * Pixels are shared between threads, which record into the tree together
+ */
+void RayTracer::RenderGuided(std::vector<PixelStats> &stats) {
+    Point3 lo, hi;
+    SceneBounds(lo, hi);
+    m_guide.Reset(lo, hi);
+    m_guided = true;
+
+    const int pixels = stats.size();
+    std::vector<float> blend(3 * pixels, 0.0f);
+    float weights = 0.0f;
+
+    const int budget = m_img.NumberOfSamples();
+    int spent = 0;
+    for (int iteration = 0; ; ++iteration) {
+        int samples = 1 << iteration;
+        const bool last = spent + 3 * samples > budget;
+        if (last) samples = budget - spent;
+        m_guideTraining = !last;
+
+        stats.assign(pixels, PixelStats());
+        Parallel::For(pixels, m_img.Width(), Threads, [&](int begin, int end) {
+            for (int p = begin; p < end; ++p)
+                for (int n = 0; n < samples; ++n)
+                    SamplePixel(p, stats[p], spent);
+        });
+        spent += samples;
+
+        // Variance of this iteration's image, from the spread of samples within each pixel
+        float variance = 0.0f;
+        for (const PixelStats &s : stats)
+            variance += s.Variance() / s.Count();
+        float weight = samples > 1 ? pixels / std::max(variance, 1e-12f) : 1e-6f;
+        for (int p = 0; p < pixels; ++p) {
+            Colour3 mean = stats[p].Mean();
+            blend[3*p] += weight * mean.r();
+            blend[3*p+1] += weight * mean.g();
+            blend[3*p+2] += weight * mean.b();
+        }
+        weights += weight;
+        if (last) break;
+
+        m_guide.Refine(GuidingSplit * std::sqrt(float(samples)), 0.01f, 20);
+        std::cerr << "Guiding iteration " << iteration << ": " << samples << " samples per pixel, "
+                  << m_guide.Leaves() << " regions" << std::endl;
+    }
+    m_guideTraining = false;
+
+    for (int p = 0; p < pixels; ++p) {
+        stats[p] = PixelStats();
+        stats[p].Add(Colour3(blend[3*p] / weights, blend[3*p+1] / weights, blend[3*p+2] / weights));
+    }
+}
+
+/*
+ * Box around every object in the scene
+ */
+void RayTracer::SceneBounds(Point3 &lo, Point3 &hi) const {
+    lo = hi = Point3();
+    if (m_objl.objects.empty()) return;
+    m_objl.objects[0]->Bounds(lo, hi);
+    for (const auto &object : m_objl.objects) {
+        Point3 olo, ohi;
+        object->Bounds(olo, ohi);
+        lo = Point3(std::min(lo.x(), olo.x()), std::min(lo.y(), olo.y()), std::min(lo.z(), olo.z()));
+        hi = Point3(std::max(hi.x(), ohi.x()), std::max(hi.y(), ohi.y()), std::max(hi.z(), ohi.z()));
+    }
+}
+
+/*
+ * Bidirectional path tracing (Veach 1997), one camera subpath and one light subpath per sample
+ * Point lights are never on a path: a surface they shine on counts as an emitter of the light
+ * DirectLighting gives it, so every strategy agrees with TraceRay on what the image is, and a
+ * light subpath from a point light starts at the surface it first hits
+ */
+void RayTracer::RenderBidirectional(std::vector<PixelStats> &stats) {
+    const int pixels = stats.size();
+    SplatBuffer splats;
+    splats.Reset(pixels);
+    Parallel::For(pixels, m_img.Width(), Threads, [&](int begin, int end) {
+        for (int p = begin; p < end; ++p)
+            for (int n = 0; n < m_img.NumberOfSamples(); ++n)
+                SampleBidirectional(p, stats[p], splats);
+    });
+
+    // Every pixel sample traced one light subpath, so splats are averaged over the same count
+    const float scale = 1.0f / m_img.NumberOfSamples();
+    for (int p = 0; p < pixels; ++p) {
+        Colour3 total = stats[p].Mean() + splats.Get(p, scale);
+        stats[p] = PixelStats();
+        stats[p].Add(total);
+    }
+}
+
+/*
+ * Trace both subpaths for the next sample of a pixel and join them in every way that makes a
+ * path of at most MaxDepth segments. What the light subpath shows the camera goes to splats
+ */
+void RayTracer::SampleBidirectional(uint32_t pixel, PixelStats &stats, SplatBuffer &splats) {
+    const int width = m_img.Width();
+    int i = pixel % width;
+    int j = m_img.Height() - 1 - int(pixel / width);
+
+    PixelSample ps(*PathSampler, pixel, stats.Count());
+    PixelSample ls(*PathSampler, MonteCarlo::HashCombine(0x6c696768u, pixel), stats.Count());
+    float u = float(i + ps.Get(SampleDim::PixelX)) / (m_img.Width()-1);
+    float v = float(j + ps.Get(SampleDim::PixelY)) / (m_img.Height()-1);
+
+    std::vector<PathVertex> camera(MaxDepth + 1), light(MaxDepth);
+    Colour3 emitted;
+    const int cameraVertices = CameraSubpath(m_cam.CameraRay(u, v), ps, camera);
+    const int lightVertices = LightSubpath(ls, light, emitted);
+
+    Colour3 total(0.0f, 0.0f, 0.0f);
+    for (int t = 1; t <= cameraVertices; ++t) {
+        for (int s = 0; s <= lightVertices; ++s) {
+            // An emitter straight to the camera is already seen by the camera subpath's first hit
+            if (s + t < 2 || s + t - 1 > MaxDepth || (s == 1 && t == 1)) continue;
+            if (t == 1)
+                SplatLight(light, s, emitted, camera, splats);
+            else
+                total += Connect(light, s, emitted, camera, t);
+        }
+    }
+    stats.Add(total);
+    ++m_paths;
+}
+
+int RayTracer::CameraSubpath(const Ray &r, const PixelSample &ps, std::vector<PathVertex> &path) {
+    PathVertex &c = path[0];
+    c = PathVertex();
+    c.Type = PathVertex::Camera;
+    c.S.Point = m_cam.Position();
+
+    int pixel;
+    float pdf = CameraImportance(m_cam.Position() + r.Direction(), pixel);
+    return RandomWalk(r, ps, true, 1.0f, pdf, path, 1);
+}
+
+/*
+ * Start a light subpath at an emitter picked by power, then continue it with RandomWalk
+ * From a point light, the subpath starts where a uniformly chosen direction first hits a surface,
+ * which sends its light on over a cosine lobe on the lit side. From an area light, it starts at a
+ * uniform point sending light over a cosine lobe on either side. Returns the number of vertices,
+ * with the colour the emitter sent along the subpath in emitted
+ */
+int RayTracer::LightSubpath(const PixelSample &ps, std::vector<PathVertex> &path, Colour3 &emitted) {
+    if (m_emitters.Empty() || path.empty()) return 0;
+    float pmf;
+    const int light = m_emitters.Sample(ps.Bounce(0, SampleDim::LightSelect), pmf);
+    const int pointLights = m_lights.size();
+    float u1 = ps.Bounce(0, SampleDim::LightPosition), u2 = ps.Bounce(0, SampleDim::LightPosition+1);
+
+    PathVertex &e = path[0];
+    e = PathVertex();
+    e.Type = PathVertex::Emitter;
+    e.Light = light;
+    Dir3 side;
+    if (light < pointLights) {
+        const Light &l = m_lights[light];
+        float z = 1.0f - 2.0f * u1;
+        float phi = 2.0f * MonteCarlo::PI * u2;
+        float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        Dir3 d(r * std::cos(phi), r * std::sin(phi), z);
+
+        ++m_segments;
+        Surfel s;
+        if (!m_objl.DoesRayIntersectSurface(Ray(l.Position(), d), 0, infinity, s))
+            return 0;
+        s.Normal = Unit(s.Normal);
+        e.S = s;
+        float distance2 = (s.Point - l.Position()).LengthSquared();
+        e.PdfFwd = pmf * std::abs(Dot(s.Normal, d)) / (4.0f * MonteCarlo::PI * distance2);
+        side = Dot(s.Normal, d) < 0.0f ? s.Normal : -s.Normal;
+    } else {
+        LightPoint lp;
+        m_areaLights.SamplePoint(light - pointLights, u1, u2, lp);
+        e.S.Point = lp.Point;
+        e.S.Normal = Unit(lp.Normal);
+        e.S.Emission = lp.Emission;
+        e.S.ObjectId = lp.ObjectId;
+        e.PdfFwd = pmf * lp.Pdf;
+        side = ps.Bounce(0, SampleDim::Lobe) < 0.5f ? e.S.Normal : -e.S.Normal;
+    }
+    if (e.PdfFwd <= 0.0f) return 0;
+    e.Beta = 1.0f / e.PdfFwd;
+
+    float pdf;
+    Dir3 w = MonteCarlo::CosineHemisphere(side, ps.Bounce(0, SampleDim::Direction), ps.Bounce(0, SampleDim::Direction+1), pdf);
+    if (pdf <= 0.0f) return 1;
+    if (light >= pointLights) pdf *= 0.5f;
+    emitted = Emitted(light, e.S, w);
+    float beta = e.Beta * Dot(side, w) / pdf;
+    return RandomWalk(Ray(e.S.Point + 0.0001f * side, w), ps, false, beta, pdf, path, 1);
+}
+
+/*
+ * Extend a subpath of n vertices along r until it leaves the scene, roulette ends it or path is
+ * full. pdf is the solid angle density r was chosen with and beta the throughput it carries.
+ * Bounces are chosen as IndirectLighting chooses them, vertex k reading block k-1 of ps on camera
+ * subpaths and block k on light subpaths. Returns the number of vertices
+ */
+int RayTracer::RandomWalk(Ray r, const PixelSample &ps, bool camera, float beta, float pdf, std::vector<PathVertex> &path, int n) {
+    float throughput = 1.0f;
+    while (n < int(path.size())) {
+        ++m_segments;
+        Surfel s;
+        bool hit = m_objl.DoesRayIntersectSurface(r, 0, infinity, s);
+        if (camera && n == 1)
+            RecordFeatures(ps.Pixel(), r, hit ? &s : nullptr);
+        if (!hit) break;
+
+        PathVertex &v = path[n];
+        PathVertex &prev = path[n-1];
+        s.Normal = Unit(s.Normal);
+        v = PathVertex();
+        v.S = s;
+        v.Beta = beta;
+        Dir3 out = Unit(-r.Direction());
+        float distance2 = (s.Point - prev.S.Point).LengthSquared();
+        v.PdfFwd = pdf * std::abs(Dot(s.Normal, out)) / distance2;
+        if (++n == int(path.size())) break;
+
+        const int depth = camera ? n - 2 : n - 1;
+        s.FaceForward(out);
+        Dir3 in;
+        float albedo, pdfRev;
+        if (ps.Bounce(depth, SampleDim::Impulse) < s.Impulse) {
+            in = 2.0f * Dot(s.Normal, out) * s.Normal - out;
+            albedo = s.ImpulseAlbedo;
+            v.Delta = true;
+            pdf = pdfRev = 0.0f;
+        } else {
+            in = s.SampleBRDF(out, ps.Bounce(depth, SampleDim::Lobe), ps.Bounce(depth, SampleDim::Direction),
+                              ps.Bounce(depth, SampleDim::Direction+1), pdf);
+            if (pdf <= 0.0f || Dot(s.Normal, in) <= 0.0f) break;
+            albedo = s.BRDF(out, in) / pdf;
+            float glossy = 1.0f - std::max(s.Impulse, 0.0f);
+            pdf *= glossy;
+            pdfRev = glossy * s.PDF(in, out);
+        }
+        // The camera is a point, so only surfaces turn a density per solid angle into one per area
+        float cosPrev = prev.Type == PathVertex::Camera ? 1.0f : std::abs(Dot(prev.S.Normal, out));
+        prev.PdfRev = pdfRev * cosPrev / distance2;
+
+        // Russian roulette on the bounces' throughput, as camera paths do in IndirectLighting
+        throughput *= albedo;
+        beta *= albedo;
+        if (depth + 1 >= MinDepth) {
+            float survival = std::min(throughput, MaxSurvival);
+            if (survival <= 0.0f || ps.Bounce(depth, SampleDim::Roulette) >= survival)
+                break;
+            throughput /= survival;
+            beta /= survival;
+        }
+        r = Ray(s.Point + 0.0001f * s.Normal, in);
+    }
+    return n;
+}
+
+/*
+ * Light carried by joining the first s light vertices to the first t camera vertices, t at least 2
+ * With no light vertices, the last camera vertex is the emitter: the area light it lies on, and
+ * every point light that shines on it, each weighted as its own strategy
+ */
+Colour3 RayTracer::Connect(const std::vector<PathVertex> &light, int s, const Colour3 &emitted,
+                           const std::vector<PathVertex> &camera, int t) {
+    Colour3 total(0.0f, 0.0f, 0.0f);
+    const PathVertex &pt = camera[t-1];
+    Dir3 back = Unit(camera[t-2].S.Point - pt.S.Point);
+
+    if (s == 0) {
+        const int pointLights = m_lights.size();
+        int area = m_areaLights.LightOf(pt.S.ObjectId);
+        if (area >= 0)
+            total += pt.S.Emission * (pt.Beta * MisWeight(light, 0, camera, t, pointLights + area));
+        for (int l = 0; l < pointLights; ++l) {
+            Colour3 shade = Emitted(l, pt.S, back);
+            if (Luminance(shade) <= 0.0f) continue;
+            Surfel f = pt.S;
+            f.FaceForward(m_lights[l].Position() - pt.S.Point);
+            ++m_segments;
+            if (!Visible(f, m_lights[l].Position())) continue;
+            total += shade * (pt.Beta * MisWeight(light, 0, camera, t, l));
+        }
+        return total;
+    }
+
+    const PathVertex &qs = light[s-1];
+    Dir3 d = qs.S.Point - pt.S.Point;
+    float distance2 = d.LengthSquared();
+    d = Unit(d);
+    float fCamera = Reflectance(pt.S, back, d);
+    if (fCamera <= 0.0f) return total;
+
+    // The emitter itself sends its own light, later light vertices reflect what they carry
+    Colour3 colour = emitted;
+    float fLight = 1.0f;
+    if (s == 1)
+        colour = Emitted(qs.Light, qs.S, -d);
+    else
+        fLight = Reflectance(qs.S, Unit(light[s-2].S.Point - qs.S.Point), -d);
+    if (fLight <= 0.0f || Luminance(colour) <= 0.0f) return total;
+
+    Surfel f = pt.S;
+    f.FaceForward(d);
+    ++m_segments;
+    if (!Visible(f, qs.S.Point)) return total;
+
+    float g = std::abs(Dot(pt.S.Normal, d)) * std::abs(Dot(qs.S.Normal, d)) / distance2;
+    float weight = MisWeight(light, s, camera, t, qs.Light);
+    return colour * (qs.Beta * fLight * g * fCamera * pt.Beta * weight);
+}
+
+/*
+ * Join the end of a light subpath of s vertices straight to the camera, splatting what is seen
+ * into the pixel it is seen through
+ */
+void RayTracer::SplatLight(const std::vector<PathVertex> &light, int s, const Colour3 &emitted,
+                           const std::vector<PathVertex> &camera, SplatBuffer &splats) {
+    const PathVertex &qs = light[s-1];
+    int pixel;
+    float importance = CameraImportance(qs.S.Point, pixel);
+    if (importance <= 0.0f) return;
+
+    Point3 eye = m_cam.Position();
+    Dir3 d = eye - qs.S.Point;
+    float distance2 = d.LengthSquared();
+    d = Unit(d);
+    Colour3 colour = emitted;
+    float f = 1.0f;
+    if (s == 1)
+        colour = Emitted(qs.Light, qs.S, d);
+    else
+        f = Reflectance(qs.S, Unit(light[s-2].S.Point - qs.S.Point), d);
+    if (f <= 0.0f || Luminance(colour) <= 0.0f) return;
+
+    Surfel v = qs.S;
+    v.FaceForward(d);
+    ++m_segments;
+    if (!Visible(v, eye)) return;
+
+    float weight = MisWeight(light, s, camera, 1, qs.Light);
+    splats.Add(pixel, colour, qs.Beta * f * std::abs(Dot(qs.S.Normal, d)) * importance / distance2 * weight);
+}
+
+/*
+ * Power heuristic weight of the strategy joining s light vertices to t camera vertices, against
+ * every other strategy that could have made the same path (after PBRT's MISWeight)
+ * The densities of the joined vertices and their neighbours being made by the other subpath are
+ * worked out here, the rest were kept in the vertices as the subpaths were traced. Strategies
+ * that would have to join at a vertex that took the impulse are left out. emitter is the light
+ * table entry of the emitting end when s is zero
+ */
+float RayTracer::MisWeight(const std::vector<PathVertex> &light, int s, const std::vector<PathVertex> &camera, int t, int emitter) const {
+    if (s + t == 2) return 1.0f;
+
+    const PathVertex *qs = s > 0 ? &light[s-1] : nullptr;
+    const PathVertex *qsMinus = s > 1 ? &light[s-2] : nullptr;
+    const PathVertex &pt = camera[t-1];
+    const PathVertex *ptMinus = t > 1 ? &camera[t-2] : nullptr;
+
+    float ptRev = qs ? VertexPdf(qsMinus, *qs, pt) : EmitterPdf(emitter, pt.S);
+    float ptMinusRev = 0.0f;
+    if (ptMinus)
+        ptMinusRev = qs ? VertexPdf(qs, pt, *ptMinus) : EmissionPdf(emitter, pt.S, *ptMinus);
+    float qsRev = qs ? VertexPdf(ptMinus, pt, *qs) : 0.0f;
+    float qsMinusRev = qsMinus ? VertexPdf(&pt, *qs, *qsMinus) : 0.0f;
+
+    // Densities of zero belong to impulses, whose strategies are skipped anyway
+    auto remap = [](float pdf) { return pdf != 0.0f ? pdf : 1.0f; };
+
+    float sum = 0.0f;
+    float ratio = 1.0f;
+    for (int i = t - 1; i > 0; --i) {
+        float rev = i == t - 1 ? ptRev : (i == t - 2 ? ptMinusRev : camera[i].PdfRev);
+        ratio *= remap(rev) / remap(camera[i].PdfFwd);
+        bool delta = i < t - 1 && camera[i].Delta;
+        if (!delta && !camera[i-1].Delta)
+            sum += ratio * ratio;
+    }
+
+    ratio = 1.0f;
+    for (int i = s - 1; i >= 0; --i) {
+        float rev = i == s - 1 ? qsRev : (i == s - 2 ? qsMinusRev : light[i].PdfRev);
+        ratio *= remap(rev) / remap(light[i].PdfFwd);
+        bool delta = i < s - 1 && light[i].Delta;
+        if (!delta && (i == 0 || !light[i-1].Delta))
+            sum += ratio * ratio;
+    }
+    return 1.0f / (1.0f + sum);
+}
+
+/*
+ * Density per unit area of vertex v, reached from prev, choosing next
+ */
+float RayTracer::VertexPdf(const PathVertex *prev, const PathVertex &v, const PathVertex &next) const {
+    if (v.Type == PathVertex::Emitter)
+        return EmissionPdf(v.Light, v.S, next);
+
+    Dir3 w = next.S.Point - v.S.Point;
+    float distance2 = w.LengthSquared();
+    w = Unit(w);
+    float pdf;
+    if (v.Type == PathVertex::Camera) {
+        int pixel;
+        pdf = CameraImportance(v.S.Point + w, pixel);
+    } else {
+        Surfel f = v.S;
+        Dir3 out = Unit(prev->S.Point - v.S.Point);
+        f.FaceForward(out);
+        float glossy = 1.0f - std::max(f.Impulse, 0.0f);
+        if (glossy <= 0.0f || Dot(f.Normal, w) <= 0.0f) return 0.0f;
+        pdf = glossy * f.PDF(out, w);
+    }
+    if (next.Type != PathVertex::Camera)
+        pdf *= std::abs(Dot(next.S.Normal, w));
+    return pdf / distance2;
+}
+
+/*
+ * Density per unit area of a light subpath starting at s from the given light
+ */
+float RayTracer::EmitterPdf(int light, const Surfel &s) const {
+    const int pointLights = m_lights.size();
+    float pmf = m_emitters.Pmf(light);
+    if (light >= pointLights)
+        return pmf / m_areaLights.Area(light - pointLights);
+
+    Dir3 d = s.Point - m_lights[light].Position();
+    float distance2 = d.LengthSquared();
+    return pmf * std::abs(Dot(s.Normal, Unit(d))) / (4.0f * MonteCarlo::PI * distance2);
+}
+
+/*
+ * Density per unit area of the light subpath starting at s going on to next
+ */
+float RayTracer::EmissionPdf(int light, const Surfel &s, const PathVertex &next) const {
+    Dir3 w = next.S.Point - s.Point;
+    float distance2 = w.LengthSquared();
+    w = Unit(w);
+
+    float pdf;
+    if (light >= int(m_lights.size())) {
+        pdf = std::abs(Dot(s.Normal, w)) / (2.0f * MonteCarlo::PI);
+    } else {
+        Dir3 lit = Dot(s.Normal, m_lights[light].Position() - s.Point) < 0.0f ? -s.Normal : s.Normal;
+        pdf = MonteCarlo::CosineHemispherePdf(lit, w);
+    }
+    if (next.Type != PathVertex::Camera)
+        pdf *= std::abs(Dot(next.S.Normal, w));
+    return pdf / distance2;
+}
+
+/*
+ * Light an emitting surface sends towards w: an area light's emission, or for a surface a point
+ * light shines on, the light DirectLighting gives it, as long as w is on the lit side
+ * Visibility of the point light is left to the caller
+ */
+Colour3 RayTracer::Emitted(int light, const Surfel &s, Dir3 w) const {
+    if (light >= int(m_lights.size()))
+        return s.Emission;
+
+    const Light &l = m_lights[light];
+    if (Dot(s.Normal, l.Position() - s.Point) * Dot(s.Normal, w) <= 0.0f)
+        return Colour3(0.0f, 0.0f, 0.0f);
+    Surfel f = s;
+    f.FaceForward(w);
+    return PointLightShading(f, w, l);
+}
+
+/*
+ * Blinn-Phong reflectance between unit directions a and b, without the cosine, scaled by the
+ * chance of not taking the impulse, which no connection can follow
+ */
+float RayTracer::Reflectance(const Surfel &s, Dir3 a, Dir3 b) const {
+    Surfel f = s;
+    f.FaceForward(a);
+    float cosB = Dot(f.Normal, b);
+    float glossy = 1.0f - std::max(f.Impulse, 0.0f);
+    if (cosB <= 0.0f || glossy <= 0.0f) return 0.0f;
+    return glossy * f.BRDF(a, b) / cosB;
+}
+
+/*
+ * Density per solid angle of camera rays heading for p, with the pixel it is seen in
+ * Camera rays are spread evenly over the image, so this is also the camera's importance. Zero,
+ * with pixel -1, when p is outside the image
+ */
+float RayTracer::CameraImportance(const Point3 &p, int &pixel) const {
+    pixel = -1;
+    float u, v, solidAngle;
+    if (!m_cam.Project(p, u, v, solidAngle)) return 0.0f;
+
+    const int width = m_img.Width(), height = m_img.Height();
+    int i = int(std::floor(u * (width - 1)));
+    int j = int(std::floor(v * (height - 1)));
+    if (i < 0 || i >= width || j < 0 || j >= height) return 0.0f;
+    pixel = (height - 1 - j) * width + i;
+
+    // Pixel i covers u from i/(width-1) to (i+1)/(width-1), and likewise for v
+    float area = float(width) * height / (float(width - 1) * (height - 1));
+    return 1.0f / (area * solidAngle);
+}
+
+/*
+ * Give every pixel MinSamples, then keep handing batches to the pixels with the largest
+ * error until they are all below ErrorThreshold, or the sample or time budget runs out
+ * Both go in parallel; a round lists each pixel once, so only one thread touches its stats
+ */
+void RayTracer::RenderAdaptive(std::vector<PixelStats> &stats) {
+    const auto start = std::chrono::steady_clock::now();
+    const int batch = std::max(MinSamples, 1);
+    long budget = long(m_img.NumberOfSamples()) * stats.size();
+
+    Parallel::For(stats.size(), m_img.Width(), Threads, [&](int begin, int end) {
+        for (int p = begin; p < end; ++p)
+            for (int n = 0; n < MinSamples; ++n)
+                SamplePixel(p, stats[p]);
+    });
+    budget -= long(MinSamples) * stats.size();
+
+    std::vector<std::pair<float, uint32_t>> noisy;
+    while (budget >= batch) {
+        if (TimeBudget > 0.0f) {
+            std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - start;
+            if (elapsed.count() >= TimeBudget) break;
+        }
+
+        // Find the pixels still above the threshold, worst first
+        noisy.clear();
+        for (uint32_t p = 0; p < stats.size(); ++p) {
+            float error = stats[p].RelativeError();
+            if (error > ErrorThreshold) noisy.emplace_back(error, p);
+        }
+        if (noisy.empty()) break;
+        std::sort(noisy.begin(), noisy.end(), std::greater<std::pair<float, uint32_t>>());
+
+        // One batch each, as far as the budget goes
+        size_t count = std::min(noisy.size(), size_t(budget / batch));
+        Parallel::For(count, 64, Threads, [&](int begin, int end) {
+            for (int k = begin; k < end; ++k)
+                for (int n = 0; n < batch; ++n)
+                    SamplePixel(noisy[k].second, stats[noisy[k].second]);
+        });
+        budget -= long(count) * batch;
+    }
+}
+
+/*
+ * Write the number of samples each pixel received as a grey scale image, brightest is most
+ */
+void RayTracer::WriteSampleMap(const std::vector<PixelStats> &stats) const {
+    std::ofstream out(SampleMapPath);
+    if (!out.is_open()) {
+        std::cerr << "Could not write sample map to " << SampleMapPath << std::endl;
+        return;
+    }
+
+    int most = 1;
+    for (const auto &s : stats) most = std::max(most, s.Count());
+
+    out << "P2\n" << m_img.Width() << ' ' << m_img.Height() << "\n255\n";
+    for (const auto &s : stats)
+        out << (255 * s.Count()) / most << '\n';
+    std::cerr << "Samples per pixel: at most " << most << ", average " << float(m_paths) / stats.size() << std::endl;
+}
+
+/*
+ * Add a camera ray's first hit, or its miss when s is null, to the pixel's features
+ */
+void RayTracer::RecordFeatures(uint32_t pixel, const Ray &r, const Surfel *s) {
+    if (m_features.empty()) return;
+    if (!s) {
+        m_features[pixel].AddMiss();
+        return;
+    }
+    Surfel facing = *s;
+    facing.FaceForward(-r.Direction());
+    m_features[pixel].Add(facing, s->At * r.Direction().Length());
+}
+
+/*
+ * Write the first hit features as images: albedo and normal (mapped from [-1,1]) in colour,
+ * depth in grey scale with the furthest hit brightest
+ */
+void RayTracer::WriteFeatures() const {
+    std::ofstream albedo(AovPrefix + "albedo.ppm");
+    std::ofstream normal(AovPrefix + "normal.ppm");
+    std::ofstream depth(AovPrefix + "depth.pgm");
+    if (!albedo.is_open() || !normal.is_open() || !depth.is_open()) {
+        std::cerr << "Could not write features to " << AovPrefix << "*" << std::endl;
+        return;
+    }
+
+    float furthest = 1e-6f;
+    for (const auto &f : m_features) furthest = std::max(furthest, f.Depth());
+
+    albedo << "P3\n" << m_img.Width() << ' ' << m_img.Height() << "\n255\n";
+    normal << "P3\n" << m_img.Width() << ' ' << m_img.Height() << "\n255\n";
+    depth << "P2\n" << m_img.Width() << ' ' << m_img.Height() << "\n255\n";
+    for (const auto &f : m_features) {
+        Colour3(f.Albedo(0), f.Albedo(1), f.Albedo(2)).WriteColor(albedo);
+        Colour3(0.5f + 0.5f * f.Normal(0), 0.5f + 0.5f * f.Normal(1), 0.5f + 0.5f * f.Normal(2)).WriteColor(normal);
+        depth << int(255.999f * f.Depth() / furthest) << '\n';
+    }
+}
+
+/*
+ * Light candidate from the light BVH for a surfel facing forward, with its source density
+ * The density is per unit area for area lights and a plain probability for point lights
+ */
+bool RayTracer::SampleCandidate(const Surfel &s, float u0, float u1, float u2, LightCandidate &c, float &pdf) const {
+    float pmf;
+    c.Light = m_lightTree.Sample(s.Point, s.Normal, u0, pmf);
+    if (c.Light < 0) return false;
+
+    const int pointLights = m_lights.size();
+    if (c.Light < pointLights) {
+        c.Point = m_lights[c.Light].Position();
+        pdf = pmf;
+    } else {
+        LightPoint lp;
+        m_areaLights.SamplePoint(c.Light - pointLights, u1, u2, lp);
+        c.Point = lp.Point;
+        c.Normal = lp.Normal;
+        pdf = pmf * lp.Pdf;
+    }
+    return pdf > 0.0f;
+}
+
+/*
+ * Unshadowed light a candidate sends out of a surfel facing forward
+ * Matches DirectLighting for point lights and AreaLighting for area lights, without their pdfs
+ */
+Colour3 RayTracer::CandidateLight(const Surfel &s, Dir3 out, const LightCandidate &c) const {
+    const int pointLights = m_lights.size();
+    Dir3 toLight = c.Point - s.Point;
+    Dir3 in = Unit(toLight);
+    if (c.Light < 0)
+        return Colour3(0.0f, 0.0f, 0.0f);
+
+    if (c.Light < pointLights) {
+        const Light &l = m_lights[c.Light];
+        return l.Diffuse * s.Diffuse3(in) + l.Specular * s.Specular3(out, in);
+    }
+
+    float cosLight = std::abs(Dot(c.Normal, in));
+    if (s.Impulse >= 1.0f || cosLight <= 0.0f || Dot(s.Normal, in) <= 0.0f)
+        return Colour3(0.0f, 0.0f, 0.0f);
+    float glossy = 1.0f - std::max(s.Impulse, 0.0f);
+    float geometry = cosLight / toLight.LengthSquared();
+    const Material &emitter = m_objl.MaterialOf(m_areaLights.Object(c.Light - pointLights));
+    return emitter.Emission * (glossy * s.BRDF(out, in) * geometry);
+}
+
+bool RayTracer::Visible(const Surfel &s, const Point3 &target) const {
+    Point3 origin = s.Point + 0.0001f * s.Normal;
+    Surfel blocker;
+    return !m_objl.DoesRayIntersectSurface(Ray(origin, target - origin), 0, 0.999f, blocker);
+}
+
+/*
+ * One pass over the image per sample. Each pass finds every pixel's first hit, fills a reservoir
+ * per pixel from fresh candidates, merges last pass's reservoir and then its neighbours', and
+ * shades direct light from the kept candidate with a single shadow ray
+ * Reuse skips neighbours whose normal or depth differ too much, trading a little bias for noise
+ * Each step goes over the pixels in parallel, and reads what the one before it left
+ */
+void RayTracer::RenderRestir(std::vector<PixelStats> &stats) {
+    const int width = m_img.Width();
+    const int height = m_img.Height();
+    const int pixels = stats.size();
+
+    // Keep last Exec's reservoirs only if the image size still matches
+    if (int(m_reservoirs.size()) != pixels || !RestirTemporal) {
+        m_reservoirs.assign(pixels, Reservoir());
+        m_firstHits.assign(pixels, Surfel());
+        m_firstHitValid.assign(pixels, false);
+    }
+
+    std::vector<Surfel> hits(pixels);
+    std::vector<Dir3> outs(pixels);
+    std::vector<Ray> rays(pixels);
+    std::vector<char> valid(pixels);
+    std::vector<Reservoir> initial(pixels);
+    std::vector<Reservoir> reused(pixels);
+
+    auto random = [&](uint32_t pixel, uint32_t index, uint32_t k) {
+        uint32_t h = MonteCarlo::HashCombine(MonteCarlo::HashCombine(m_frame, pixel), index);
+        return MonteCarlo::UintToFloat(MonteCarlo::Hash(MonteCarlo::HashCombine(h, k)));
+    };
+    auto target = [&](int p, const LightCandidate &c) {
+        return Luminance(CandidateLight(hits[p], outs[p], c));
+    };
+    auto similar = [&](int a, const Surfel &b) {
+        return Dot(hits[a].Normal, b.Normal) > 0.9f && std::abs(hits[a].At - b.At) < 0.1f * hits[a].At;
+    };
+
+    for (int n = 0; n < m_img.NumberOfSamples(); ++n, ++m_frame) {
+        // First hits and initial candidates
+        Parallel::For(pixels, width, Threads, [&](int begin, int end) {
+            for (int p = begin; p < end; ++p) {
+                int i = p % width;
+                int j = height - 1 - p / width;
+                PixelSample ps(*PathSampler, p, stats[p].Count());
+                float u = float(i + ps.Get(SampleDim::PixelX)) / (m_img.Width()-1);
+                float v = float(j + ps.Get(SampleDim::PixelY)) / (m_img.Height()-1);
+                rays[p] = m_cam.CameraRay(u, v);
+                initial[p] = Reservoir();
+
+                valid[p] = m_objl.DoesRayIntersectSurface(rays[p], -infinity, infinity, hits[p]);
+                RecordFeatures(p, rays[p], valid[p] ? &hits[p] : nullptr);
+                if (!valid[p]) continue;
+                outs[p] = Unit(-rays[p].Direction());
+                hits[p].FaceForward(outs[p]);
+
+                for (int k = 0; k < RestirCandidates; ++k) {
+                    LightCandidate c;
+                    float pdf;
+                    float u0 = random(p, n, 3*k), u1 = random(p, n, 3*k+1), u2 = random(p, n, 3*k+2);
+                    if (!SampleCandidate(hits[p], u0, u1, u2, c, pdf)) {
+                        initial[p].M += 1.0f;
+                        continue;
+                    }
+                    initial[p].Update(c, target(p, c) / pdf, random(p, n, 3*RestirCandidates + k));
+                }
+                initial[p].Finalise(target(p, initial[p].Sample));
+
+                // Candidates the pixel cannot see add nothing to reuse
+                if (!Visible(hits[p], initial[p].Sample.Point)) initial[p].W = 0.0f;
+
+                // Temporal reuse, with the history capped so old samples cannot dominate
+                if (RestirTemporal && m_firstHitValid[p] && similar(p, m_firstHits[p])) {
+                    Reservoir history = m_reservoirs[p];
+                    history.M = std::min(history.M, 20.0f * std::max(initial[p].M, 1.0f));
+                    initial[p].Merge(history, target(p, history.Sample), random(p, n, 4*RestirCandidates));
+                    initial[p].Finalise(target(p, initial[p].Sample));
+                }
+            }
+        });
+
+        // Spatial reuse from a few neighbours
+        Parallel::For(pixels, width, Threads, [&](int begin, int end) {
+            for (int p = begin; p < end; ++p) {
+                reused[p] = initial[p];
+                if (!valid[p]) continue;
+                int i = p % width;
+                int j = p / width;
+                for (int k = 0; k < RestirNeighbours; ++k) {
+                    float radius = RestirRadius * std::sqrt(random(p, n, 5*RestirCandidates + 2*k));
+                    float angle = 2.0f * MonteCarlo::PI * random(p, n, 5*RestirCandidates + 2*k + 1);
+                    int ni = i + int(std::lround(radius * std::cos(angle)));
+                    int nj = j + int(std::lround(radius * std::sin(angle)));
+                    if (ni < 0 || nj < 0 || ni >= width || nj >= height) continue;
+                    int q = nj * width + ni;
+                    if (q == p || !valid[q] || !similar(p, hits[q])) continue;
+                    reused[p].Merge(initial[q], target(p, initial[q].Sample), random(p, n, 6*RestirCandidates + k));
+                }
+                reused[p].Finalise(target(p, reused[p].Sample));
+            }
+        });
+
+        // Shade: emission, resampled direct light, then the rest of the path as usual
+        Parallel::For(pixels, width, Threads, [&](int begin, int end) {
+            for (int p = begin; p < end; ++p) {
+                PixelSample ps(*PathSampler, p, stats[p].Count());
+                ++m_paths;
+                ++m_segments;
+                if (!valid[p]) {
+                    stats[p].Add(Colour3(0.0f, 0.0f, 0.0f));
+                    continue;
+                }
+
+                const Surfel &s = hits[p];
+                Colour3 total = s.Emission;
+                const Reservoir &r = reused[p];
+                if (r.W > 0.0f && Visible(s, r.Sample.Point))
+                    total += CandidateLight(s, outs[p], r.Sample) * r.W;
+                total += CausticLight(s, outs[p]);
+
+                PathState path;
+                path.LightsResampled = true;
+                total += IndirectLighting(s, -rays[p].Direction(), path, ps);
+                stats[p].Add(total);
+            }
+        });
+
+        // Keep this pass's reservoirs for the next
+        m_reservoirs = reused;
+        for (int p = 0; p < pixels; ++p) {
+            m_firstHits[p] = hits[p];
+            m_firstHitValid[p] = valid[p];
+        }
+    }
+}
+
+Light RayTracer::DefaultLight() {
     Light light(Point3(0.0f, 0.95f, 0.0f), Colour3(1.0f, 1.0f, 1.0f));
     light.Diffuse = light.Colour() * 0.5f;
     light.Ambient = light.Diffuse * 0.2f;
-    m_lights.emplace_back(light);
-
-    // Write header of image file
-    std::cout << "P3\n" << m_img.Width() << ' ' << m_img.Height() << "\n255\n";
-
-    // Store the colours in an array
-    std::vector<Colour3> buffer;
-
-    // Start with no colour
-    for (int j = m_img.Height()-1; j >= 0; --j) {
-        for (int i = 0; i < m_img.Width(); ++i) {
-            Colour3 c(0.0f, 0.0f, 0.0f);
-            buffer.emplace_back(c);
-        }
-    }
-
-    // For each pixel, trace a ray from the camera position
-    for (int j = m_img.Height()-1; j >= 0; --j) {
-        // std::cerr << j << " lines left" << std::endl;
-        for (int i = 0; i < m_img.Width(); ++i) {
-            // Somewhere to store collected colour
-            float r = 0.0f;
-            float g = 0.0f;
-            float b = 0.0f;
-
-            // Collect samples
-            for (int n = 0; n < m_img.NumberOfSamples(); ++n) {
-                float u = float(i + MonteCarlo::RandomFloat()) / (m_img.Width()-1);
-                float v = float(j + MonteCarlo::RandomFloat()) / (m_img.Height()-1);
-                Colour3 c = TraceRay(m_cam.CameraRay(u, v), -infinity, infinity, 10);
-                r += c.r();
-                g += c.g();
-                b += c.b();
-            }
-            // Now average out sample collection to get the final colour
-            float scale = 1.0f / m_img.NumberOfSamples();
-            r *= scale;
-            g *= scale;
-            b *= scale;
+    return light;
+}
 
-            // Set this colour for the pixel
-            buffer[(m_img.Height()-j-1)*m_img.Width()+i] = Colour3(r, g, b);
-        }
+/*
+ * Set up everything that depends on the lights and materials, before rendering
+ */
+void RayTracer::PrepareScene() {
+    // Init with one light only, unless given lights
+    m_lights = Lights;
+    if (m_lights.empty())
+        m_lights.push_back(DefaultLight());
+    m_paths = 0;
+    m_segments = 0;
+
+    // Every emissive object is also an area light
+    BuildLights();
+    EmitPhotons();
+
+    // Irradiance records from a previous Exec may be stale, start over within the scene's bounds
+    if (IrradianceCaching) {
+        Point3 lo, hi;
+        SceneBounds(lo, hi);
+        Cache.Reset(lo, hi);
     }
+    m_guided = false;
+
+    // Incremental renders keep the features of the pixels they keep
+    const size_t pixels = size_t(m_img.Width()) * m_img.Height();
+    if (!(Denoise || WriteAovs) || !StreamPath.empty())
+        m_features.clear();
+    else if (!Incremental || m_features.size() != pixels)
+        m_features.assign(pixels, PixelFeatures());
+}
 
-    // Write colour
-    for (unsigned int i = 0; i < buffer.size(); ++i) {
-        buffer[i].WriteColor(std::cout);
+/*
+ * The average of each pixel's samples, denoised when asked for
+ */
+std::vector<Colour3> RayTracer::FinalPixels(const std::vector<PixelStats> &stats) {
+    std::vector<Colour3> pixels;
+    for (const auto &s : stats)
+        pixels.push_back(s.Mean());
+    if (Denoise)
+        pixels = Filter.Run(m_img.Width(), m_img.Height(), pixels, m_features);
+    return pixels;
+}
+
+/*
+ * Write an image in format, to stdout when the path is empty
+ */
+bool RayTracer::WriteImage(const Framebuffer &frame, const std::string &path, ImageFormat format) const {
+    if (ImageFile::Write(path, ImageFile::Encode(frame, format, Display, Threads)))
+        return true;
+    std::cerr << "Could not write " << (path.empty() ? "the image" : path) << std::endl;
+    return false;
+}
+
+std::vector<std::vector<Colour3>> RayTracer::RenderVariants(const std::vector<Variant> &variants) {
+    // The scene as it is, to go back to after each variant
+    const MaterialTable materials = m_objl.materials;
+    std::vector<uint16_t> ids;
+    for (const auto &object : m_objl.objects)
+        ids.push_back(object->MaterialId);
+    const std::vector<Light> lights = Lights;
+
+    std::vector<std::vector<Colour3>> images;
+    for (const auto &variant : variants) {
+        // Variants edit the lights Exec would use
+        if (Lights.empty())
+            Lights.push_back(DefaultLight());
+        variant(m_objl, Lights);
+        PrepareScene();
+
+        std::vector<PixelStats> stats(size_t(m_img.Width()) * m_img.Height());
+        RenderCached(stats);
+        images.push_back(FinalPixels(stats));
+
+        m_objl.materials = materials;
+        for (size_t i = 0; i < ids.size(); ++i)
+            m_objl.objects[i]->MaterialId = ids[i];
+        Lights = lights;
+    }
+    return images;
+}
+
+/*
+ * Say which modes that are on Exec leaves out, as it takes the first in this order
+ */
+void RayTracer::ReportIgnoredModes() const {
+    const bool checkpointed = !CheckpointPath.empty();
+    const std::pair<bool, const char*> modes[] = {
+        {!StreamPath.empty(), "streaming"}, {Restir, "ReSTIR"}, {Adaptive, "adaptive sampling"},
+        {Guiding, "path guiding"}, {Bidirectional, "bidirectional rendering"},
+        {Incremental, "incremental rendering"}, {CacheFirstHits, "first hit caching"},
+        {Progressive, "progressive rendering"}, {checkpointed, "checkpointing"}, {Rasterize, "rasterising"}};
+
+    // Progressive passes also checkpoint
+    const int progressive = 7, checkpointing = 8;
+    int used = -1;
+    for (int m = 0; m < int(sizeof(modes) / sizeof(modes[0])); ++m) {
+        if (!modes[m].first) continue;
+        if (used < 0)
+            used = m;
+        else if (!(used == progressive && m == checkpointing))
+            std::cerr << "Ignoring " << modes[m].second << ", which does not go with " << modes[used].second << std::endl;
+    }
+}
+
+int RayTracer::Exec() {
+    m_cancel = false;
+    ReportIgnoredModes();
+    PrepareScene();
+    if (!Incremental) {
+        m_kept.clear();
+        m_keptBounds.clear();
+        m_touched.clear();
+    }
+
+    // Streamed images are never held whole. Every other way of rendering holds each pixel and
+    // numbers them with an int
+    if (!StreamPath.empty())
+        return RenderStreamed() ? 0 : 1;
+    if (size_t(m_img.Width()) * m_img.Height() > size_t(std::numeric_limits<int>::max())) {
+        std::cerr << "Image too large to hold, set StreamPath to stream it" << std::endl;
+        return 1;
+    }
+
+    // Running statistics of each pixel, top row first
+    std::vector<PixelStats> stats(size_t(m_img.Width()) * m_img.Height());
+
+    bool written = false, writeOk = true;
+    if (Restir) {
+        RenderRestir(stats);
+    } else if (Adaptive) {
+        RenderAdaptive(stats);
+    } else if (Guiding) {
+        RenderGuided(stats);
+    } else if (Bidirectional) {
+        RenderBidirectional(stats);
+    } else if (Incremental) {
+        RenderIncremental(stats);
+    } else if (CacheFirstHits) {
+        RenderCached(stats);
+    } else if (Progressive) {
+        RenderProgressive(stats);
+    } else if (!CheckpointPath.empty()) {
+        RenderCheckpointed(stats);
+    } else if (Rasterize && m_raster.Build(m_objl, m_cam, m_img.Width(), m_img.Height())) {
+        RenderRasterized(stats);
+    } else {
+        if (Rasterize)
+            std::cerr << "Some objects cannot be rasterised, tracing camera rays instead" << std::endl;
+        // For each pixel, trace a ray from the camera position, writing rows out as they finish
+        // when the image allows it
+        writeOk = RenderPlain(stats, written);
     }
+
+    // Report how far paths travelled on average
+    if (m_paths > 0)
+        std::cerr << "Average path length: " << float(m_segments) / m_paths << std::endl;
+    if (IrradianceCaching)
+        std::cerr << "Irradiance records: " << Cache.Size() << std::endl;
+    if (Caustics)
+        std::cerr << "Caustic photons: " << m_caustics.Size() << std::endl;
+
+    // Write the average of each pixel's samples
+    if (written ? !writeOk : !WriteImage(Framebuffer(m_img.Width(), m_img.Height(), FinalPixels(stats)), OutputPath, OutputFormat))
+        return 1;
+
+    if (Adaptive)
+        WriteSampleMap(stats);
+    if (WriteAovs)
+        WriteFeatures();
     return 0;
 }
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,55 @@
+#ifndef RESERVOIR_H
+#define RESERVOIR_H
+
+#include "vec3.h"
+
+/*
+ * A light sample that can be re-evaluated at any shading point
+ * Light indexes the light BVH, point lights first then area lights. Point is the position on
+ * the light, Normal its surface normal there (unused for point lights)
+ */
+struct LightCandidate {
+    int Light = -1;
+    Point3 Point;
+    Dir3 Normal;
+};
+
+/*
+ * Reservoir
+ * Weighted reservoir sampling over light candidates, as used by ReSTIR
+ * (Bitterli et al. 2020, "Spatiotemporal reservoir resampling for real-time ray tracing with
+ * dynamic direct lighting"). Keeps one candidate, the running weight sum and how many
+ * candidates it has seen. W is the unbiased contribution weight of the kept candidate
+ */
+struct Reservoir {
+    LightCandidate Sample;
+    float WeightSum = 0.0f;
+    float M = 0.0f;
+    float W = 0.0f;
+
+    // Stream in one candidate with resampling weight w, u uniform in [0,1)
+    bool Update(const LightCandidate &c, float w, float u) {
+        WeightSum += w;
+        M += 1.0f;
+        if (w > 0.0f && u * WeightSum < w) {
+            Sample = c;
+            return true;
+        }
+        return false;
+    }
+
+    // Merge another reservoir whose sample has target value targetHere at this pixel
+    bool Merge(const Reservoir &r, float targetHere, float u) {
+        float m = M;
+        bool taken = Update(r.Sample, targetHere * r.W * r.M, u);
+        M = m + r.M;
+        return taken;
+    }
+
+    // Recompute W once all candidates are in, given the target value of the kept sample
+    void Finalise(float target) {
+        W = (target > 0.0f && M > 0.0f) ? WeightSum / (M * target) : 0.0f;
+    }
+};
+
+#endif
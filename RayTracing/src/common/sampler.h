@@ -0,0 +1,213 @@
+#ifndef SAMPLER_H
+#define SAMPLER_H
+
+#include <cstdint>
+#include <memory>
+
+#include "montecarlo.h"
+
+/*
+ * Where each random decision of a path reads from in the sample vector
+ * Pixel jitter uses the first two dimensions, then every bounce owns a fixed block so
+ * the same decision always lands on the same dimension whatever happened earlier
+ */
+namespace SampleDim {
+const uint32_t PixelX = 0;
+const uint32_t PixelY = 1;
+const uint32_t FirstBounce = 2;
+const uint32_t PerBounce = 8;
+
+// Offsets inside a bounce block
+const uint32_t Impulse = 0;
+const uint32_t Lobe = 1;
+const uint32_t Direction = 2; // and 3
+const uint32_t Roulette = 4;
+const uint32_t LightSelect = 5;
+const uint32_t LightPosition = 6; // and 7
+}
+
+/*
+ * Sampler
+ * Returns the value in [0,1) of one dimension of one sample of one pixel
+ * Samplers hold no per-pixel state, so any thread can ask for any sample in any order. Pixels
+ * are numbered with 64 bits so streamed images past 2^32 pixels still get a sequence each
+ */
+class Sampler {
+public:
+    virtual ~Sampler() {};
+    virtual float Get(uint64_t pixel, uint32_t index, uint32_t dim) const = 0;
+
+    // Hash of a few samples, telling samplers or seeds apart
+    uint32_t Fingerprint() const {
+        uint32_t h = 0;
+        for (uint32_t dim = 0; dim < 8; ++dim)
+            h = MonteCarlo::HashCombine(h, uint32_t(Get(dim, 1, dim) * 4294967040.0f));
+        return h;
+    }
+};
+
+/*
+ * Independent uniform numbers, hashed from the sample coordinates
+ */
+class IndependentSampler : public Sampler {
+public:
+    IndependentSampler(uint32_t seed = 0) : m_seed(seed) {};
+
+    virtual float Get(uint64_t pixel, uint32_t index, uint32_t dim) const override {
+        uint32_t h = MonteCarlo::HashPixel(m_seed, pixel);
+        h = MonteCarlo::HashCombine(h, index);
+        h = MonteCarlo::HashCombine(h, dim);
+        return MonteCarlo::UintToFloat(MonteCarlo::Hash(h));
+    }
+
+private:
+    uint32_t m_seed;
+};
+
+/*
+ * Owen-scrambled Sobol sequence
+ * Follows Burley 2020, "Practical Hash-based Owen Scrambling". Dimensions are taken in pairs
+ * from the first two Sobol dimensions, and each pair gets its own shuffle of the sample index
+ * and its own nested uniform scramble, seeded by pixel and pair
+ */
+class SobolSampler : public Sampler {
+public:
+    SobolSampler(uint32_t seed = 0) : m_seed(seed) {
+        // Dimension 0 is the van der Corput sequence, dimension 1 comes from polynomial x + 1
+        for (int bit = 0; bit < 32; ++bit)
+            m_v[0][bit] = 1u << (31 - bit);
+        m_v[1][0] = 1u << 31;
+        for (int bit = 1; bit < 32; ++bit)
+            m_v[1][bit] = m_v[1][bit-1] ^ (m_v[1][bit-1] >> 1);
+    }
+
+    virtual float Get(uint64_t pixel, uint32_t index, uint32_t dim) const override {
+        uint32_t seed = MonteCarlo::HashCombine(MonteCarlo::HashPixel(m_seed, pixel), dim / 2);
+        uint32_t shuffled = NestedUniformScramble(index, seed);
+        uint32_t x = Sobol(shuffled, dim & 1);
+        return MonteCarlo::UintToFloat(NestedUniformScramble(x, MonteCarlo::HashCombine(seed, dim & 1)));
+    }
+
+private:
+    uint32_t Sobol(uint32_t index, int dim) const {
+        uint32_t x = 0;
+        for (int bit = 0; index != 0; ++bit, index >>= 1)
+            if (index & 1) x ^= m_v[dim][bit];
+        return x;
+    }
+
+    static uint32_t ReverseBits(uint32_t x) {
+        x = ((x >> 1) & 0x55555555u) | ((x & 0x55555555u) << 1);
+        x = ((x >> 2) & 0x33333333u) | ((x & 0x33333333u) << 2);
+        x = ((x >> 4) & 0x0f0f0f0fu) | ((x & 0x0f0f0f0fu) << 4);
+        x = ((x >> 8) & 0x00ff00ffu) | ((x & 0x00ff00ffu) << 8);
+        return (x >> 16) | (x << 16);
+    }
+
+    static uint32_t LaineKarrasPermutation(uint32_t x, uint32_t seed) {
+        x += seed;
+        x ^= x * 0x6c50b47cu;
+        x ^= x * 0xb82f1e52u;
+        x ^= x * 0xc7afe638u;
+        x ^= x * 0x8d22f6e6u;
+        return x;
+    }
+
+    static uint32_t NestedUniformScramble(uint32_t x, uint32_t seed) {
+        return ReverseBits(LaineKarrasPermutation(ReverseBits(x), seed));
+    }
+
+private:
+    uint32_t m_seed;
+    uint32_t m_v[2][32];
+};
+
+/*
+ * Owen-scrambled Halton sequence
+ * Each dimension uses the radical inverse in its own prime base. Every digit goes through a
+ * hashed permutation seeded by pixel, dimension and the digits before it, which is Owen
+ * scrambling in base b. Dimensions past the prime table fall back to independent numbers
+ */
+class HaltonSampler : public Sampler {
+public:
+    HaltonSampler(uint32_t seed = 0) : m_seed(seed), m_fallback(seed) {};
+
+    virtual float Get(uint64_t pixel, uint32_t index, uint32_t dim) const override {
+        if (dim >= NumPrimes) return m_fallback.Get(pixel, index, dim);
+
+        const uint32_t base = Primes[dim];
+        const double invBase = 1.0 / base;
+        uint32_t seed = MonteCarlo::HashCombine(MonteCarlo::HashPixel(m_seed, pixel), dim);
+
+        // Scramble every digit up to float precision, including the leading zeros
+        uint64_t reversed = 0;
+        double invBaseN = 1.0;
+        while (invBaseN > 1e-8) {
+            uint32_t next = index / base;
+            uint32_t digit = index - next * base;
+            uint32_t digitSeed = MonteCarlo::Hash(seed ^ uint32_t(reversed));
+            reversed = reversed * base + PermutationElement(digit, base, digitSeed);
+            invBaseN *= invBase;
+            index = next;
+        }
+        return std::min(float(reversed * invBaseN), 0.99999994f);
+    }
+
+private:
+    /*
+     * Element i of a hashed permutation of [0,l), from Kensler 2013, "Correlated Multi-Jittered Sampling"
+     */
+    static uint32_t PermutationElement(uint32_t i, uint32_t l, uint32_t p) {
+        uint32_t w = l - 1;
+        w |= w >> 1;
+        w |= w >> 2;
+        w |= w >> 4;
+        w |= w >> 8;
+        w |= w >> 16;
+        do {
+            i ^= p; i *= 0xe170893du; i ^= p >> 16;
+            i ^= (i & w) >> 4; i ^= p >> 8; i *= 0x0929eb3fu;
+            i ^= p >> 23; i ^= (i & w) >> 1; i *= 1 | p >> 27;
+            i *= 0x6935fa69u; i ^= (i & w) >> 11; i *= 0x74dcb303u;
+            i ^= (i & w) >> 2; i *= 0x9e501cc3u; i ^= (i & w) >> 2;
+            i *= 0xc860a3dfu; i &= w; i ^= i >> 5;
+        } while (i >= l);
+        return (i + p) % l;
+    }
+
+private:
+    static const uint32_t NumPrimes = 64;
+    static constexpr uint32_t Primes[NumPrimes] = {
+        2, 3, 5, 7, 11, 13, 17, 19, 23, 29, 31, 37, 41, 43, 47, 53,
+        59, 61, 67, 71, 73, 79, 83, 89, 97, 101, 103, 107, 109, 113, 127, 131,
+        137, 139, 149, 151, 157, 163, 167, 173, 179, 181, 191, 193, 197, 199, 211, 223,
+        227, 229, 233, 239, 241, 251, 257, 263, 269, 271, 277, 281, 283, 293, 307, 311
+    };
+
+    uint32_t m_seed;
+    IndependentSampler m_fallback;
+};
+
+/*
+ * PixelSample
+ * One sample of one pixel, handed down a path so each decision can read its dimension
+ */
+class PixelSample {
+public:
+    PixelSample(const Sampler &sampler, uint64_t pixel, uint32_t index) : m_sampler(sampler), m_pixel(pixel), m_index(index) {};
+
+    float Get(uint32_t dim) const { return m_sampler.Get(m_pixel, m_index, dim); };
+    float Bounce(int depth, uint32_t offset) const {
+        return Get(SampleDim::FirstBounce + depth * SampleDim::PerBounce + offset);
+    };
+
+    uint64_t Pixel() const { return m_pixel; };
+    uint32_t Index() const { return m_index; };
+
+private:
+    const Sampler &m_sampler;
+    uint64_t m_pixel;
+    uint32_t m_index;
+};
+
+#endif
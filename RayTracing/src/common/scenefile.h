@@ -0,0 +1,274 @@
+#ifndef SCENEFILE_H
+#define SCENEFILE_H
+
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "camera.h"
+#include "image.h"
+#include "imagefile.h"
+#include "light.h"
+#include "material.h"
+#include "meshcache.h"
+#include "objectlist.h"
+#include "plane.h"
+#include "raytracer.h"
+#include "sphere.h"
+
+/*
+ * SceneFile
+ * A scene read from a text file of one keyword and its values per line, # starting a comment
+ *
+ *   image <width> <aspect ratio> <samples per pixel>
+ *   camera <position> <look at> <up> <viewport height> <distance to viewport>
+ *   light <position> <diffuse colour>
+ *   newmtl <name>                  then Ka, Kd, Ks, Ke, Ns, impulse and albedo lines for it
+ *   usemtl <name>                  material of the planes and spheres that follow
+ *   plane <lower left> <upper left> <lower right> <upper right> <normal>
+ *   sphere <centre> <radius>
+ *   mesh <obj file>                its triangles, with the materials of its mtl files
+ *   output <image file>            where the image goes when --output does not say
+ *   exposure <scale>
+ *   gamma <gamma>
+ *
+ * Points, directions and colours are three numbers. Mesh and output paths are relative to the
+ * scene file, and meshes are read through a MeshCache, so scenes naming the same mesh share it.
+ * Without a camera
+ * line the scene has the default camera, without light lines the default light
+ */
+class SceneFile {
+public:
+    SceneFile(const std::string &path, MeshCache &meshes);
+
+    bool IsSuccess() const { return m_success; };
+    const ObjectList &World() const { return m_world; };
+    Camera GetCamera() const;
+    Image GetImage() const { return Image(m_aspect, m_width, int(m_width / m_aspect), m_samples); };
+
+    // Give a RayTracer made from this scene its lights and display settings
+    void Configure(RayTracer &rayTracer) const;
+    // Image path of the output line, empty without one
+    const std::string &Output() const { return m_output; };
+
+    // Scene paths listed one per line in a batch file, relative to it. Returns false on failure
+    static bool ReadBatch(const std::string &path, std::vector<std::string> &scenes);
+
+    // File name of a scene without its directory and extension, "cornell" for "a/cornell.scene"
+    static std::string Name(const std::string &scene);
+    // path with the scene's name put before its extension, "out.cornell.ppm" for "out.ppm"
+    static std::string PathFor(const std::string &path, const std::string &scene);
+
+private:
+    bool ParseLine(const std::string &key, std::istream &in, MeshCache &meshes);
+    void AssignMaterials(const MeshCache &meshes);
+
+    static std::string Directory(const std::string &path) { return path.substr(0, path.find_last_of('/') + 1); };
+    static std::string Relative(const std::string &dir, const std::string &path) { return path[0] == '/' ? path : dir + path; };
+    static bool ParseVec(std::istream &in, Vec3 &v);
+    static bool ParseColour(std::istream &in, Colour3 &c);
+    static bool ParseName(std::istream &in, std::string &name);
+
+    bool m_success = true;
+    std::string m_dir;
+    ObjectList m_world;
+
+    // Materials as the file gives them, and the one each plane or sphere uses as an index into
+    // them plus one, zero for the default. Ids in the world's table are known once meshes are read
+    std::vector<std::pair<std::string, Material>> m_materials;
+    std::vector<std::pair<std::shared_ptr<Object>, int>> m_uses;
+    int m_material = 0;
+
+    int m_width = 800;
+    float m_aspect = 16.0f / 9.0f;
+    int m_samples = 50;
+
+    bool m_camera = false;
+    Point3 m_position, m_lookAt;
+    Dir3 m_up;
+    float m_viewPortHeight = 3.0f;
+    float m_distance = 6.0f;
+
+    std::vector<Light> m_lights;
+    std::string m_output;
+    float m_exposure = 1.0f;
+    float m_gamma = 1.0f;
+};
+
+SceneFile::SceneFile(const std::string &path, MeshCache &meshes) : m_dir(Directory(path)) {
+    std::ifstream in(path, std::ifstream::in);
+    if (!in.is_open()) {
+        std::cerr << "Could not open scene " << path << std::endl;
+        m_success = false;
+        return;
+    }
+
+    std::string line;
+    for (int number = 1; std::getline(in, line); ++number) {
+        std::stringstream ss(line.substr(0, line.find('#')));
+        std::string key;
+        if (!(ss >> key)) continue;
+        if (!ParseLine(key, ss, meshes)) {
+            std::cerr << path << ":" << number << ": could not read " << key << " line" << std::endl;
+            m_success = false;
+            return;
+        }
+    }
+    AssignMaterials(meshes);
+}
+
+bool SceneFile::ParseLine(const std::string &key, std::istream &in, MeshCache &meshes) {
+    if (key == "image") {
+        return in >> m_width >> m_aspect >> m_samples && m_width > 0 && m_aspect > 0.0f && m_samples > 0;
+    }
+    if (key == "camera") {
+        m_camera = true;
+        return ParseVec(in, m_position) && ParseVec(in, m_lookAt) && ParseVec(in, m_up) &&
+               in >> m_viewPortHeight >> m_distance;
+    }
+    if (key == "light") {
+        Point3 p;
+        Colour3 c;
+        if (!ParseVec(in, p) || !ParseColour(in, c)) return false;
+        Light light(p, c);
+        light.Diffuse = c;
+        light.Ambient = c * 0.2f;
+        m_lights.push_back(light);
+        return true;
+    }
+    if (key == "newmtl") {
+        std::string name;
+        if (!ParseName(in, name)) return false;
+        m_materials.emplace_back(name, Material());
+        return true;
+    }
+    if (key == "usemtl") {
+        std::string name;
+        if (!ParseName(in, name)) return false;
+        for (size_t i = 0; i < m_materials.size(); ++i)
+            if (m_materials[i].first == name) m_material = i + 1;
+        return m_material > 0 && m_materials[m_material - 1].first == name;
+    }
+    if (key == "plane") {
+        Point3 ll, lu, rl, ru;
+        Dir3 n;
+        if (!ParseVec(in, ll) || !ParseVec(in, lu) || !ParseVec(in, rl) || !ParseVec(in, ru) || !ParseVec(in, n))
+            return false;
+        m_uses.emplace_back(std::make_shared<Plane>(ll, lu, rl, ru, n), m_material);
+        return true;
+    }
+    if (key == "sphere") {
+        Point3 c;
+        float r;
+        if (!ParseVec(in, c) || !(in >> r)) return false;
+        m_uses.emplace_back(std::make_shared<Sphere>(c, r), m_material);
+        return true;
+    }
+    if (key == "mesh") {
+        std::string name;
+        if (!ParseName(in, name)) return false;
+        const auto *tris = meshes.Get(Relative(m_dir, name));
+        if (!tris) return false;
+        // Placeholders keep the order of objects as the file gives it
+        for (const auto &tri : *tris)
+            m_uses.emplace_back(tri, -1);
+        return true;
+    }
+    if (key == "output") {
+        if (!ParseName(in, m_output)) return false;
+        m_output = Relative(m_dir, m_output);
+        return true;
+    }
+    if (key == "exposure") return bool(in >> m_exposure);
+    if (key == "gamma") return bool(in >> m_gamma) && m_gamma > 0.0f;
+
+    // Anything else describes the material newmtl last named
+    return !m_materials.empty() && ReadMaterialValue(key, in, m_materials.back().second);
+}
+
+/*
+ * The world's table starts as the cache's, which holds the materials of every mesh read, then
+ * gains the file's own. Mesh triangles keep the ids they were read with
+ */
+void SceneFile::AssignMaterials(const MeshCache &meshes) {
+    m_world.materials = meshes.Materials();
+    std::vector<uint16_t> ids(m_materials.size() + 1, 0);
+    for (size_t i = 0; i < m_materials.size(); ++i)
+        ids[i + 1] = m_world.materials.Add(m_materials[i].second, m_materials[i].first);
+
+    for (const auto &use : m_uses) {
+        if (use.second >= 0)
+            use.first->MaterialId = ids[use.second];
+        m_world.add(use.first);
+    }
+    m_uses.clear();
+}
+
+Camera SceneFile::GetCamera() const {
+    if (!m_camera) return Camera();
+    return Camera(m_position, m_lookAt, m_up, m_viewPortHeight, m_distance, m_aspect);
+}
+
+void SceneFile::Configure(RayTracer &rayTracer) const {
+    rayTracer.Lights = m_lights;
+    rayTracer.Display.Exposure = m_exposure;
+    rayTracer.Display.Gamma = m_gamma;
+}
+
+bool SceneFile::ReadBatch(const std::string &path, std::vector<std::string> &scenes) {
+    std::ifstream in(path, std::ifstream::in);
+    if (!in.is_open()) {
+        std::cerr << "Could not open batch " << path << std::endl;
+        return false;
+    }
+    std::string line;
+    while (std::getline(in, line)) {
+        std::stringstream ss(line.substr(0, line.find('#')));
+        std::string name;
+        if (ParseName(ss, name))
+            scenes.push_back(Relative(Directory(path), name));
+    }
+    return true;
+}
+
+std::string SceneFile::Name(const std::string &scene) {
+    std::string name = scene.substr(scene.find_last_of('/') + 1);
+    return name.substr(0, name.find_last_of('.'));
+}
+
+std::string SceneFile::PathFor(const std::string &path, const std::string &scene) {
+    size_t dot = path.find_last_of('.');
+    size_t slash = path.find_last_of('/');
+    if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+        return path + "." + Name(scene);
+    return path.substr(0, dot) + "." + Name(scene) + path.substr(dot);
+}
+
+bool SceneFile::ParseVec(std::istream &in, Vec3 &v) {
+    float x, y, z;
+    if (!(in >> x >> y >> z)) return false;
+    v = Vec3(x, y, z);
+    return true;
+}
+
+bool SceneFile::ParseColour(std::istream &in, Colour3 &c) {
+    float r, g, b;
+    if (!(in >> r >> g >> b)) return false;
+    c = Colour3(r, g, b);
+    return true;
+}
+
+/*
+ * Rest of the line, without the spaces around it, so names may hold spaces
+ */
+bool SceneFile::ParseName(std::istream &in, std::string &name) {
+    if (!std::getline(in >> std::ws, name)) return false;
+    size_t end = name.find_last_not_of(" \t\r");
+    name = end == std::string::npos ? "" : name.substr(0, end + 1);
+    return !name.empty();
+}
+
+#endif
@@ -0,0 +1,343 @@
+#ifndef SDTREE_H
+#define SDTREE_H
+
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+#include <algorithm>
+
+#include "montecarlo.h"
+#include "parallel.h"
+#include "vec3.h"
+
+/*
+ * DTree
+ * Quadtree over the square [0,1]^2 that directions map to, holding the energy arriving in each
+ * quadrant of each node (Muller et al. 2017, "Practical Path Guiding for Efficient Light-Transport
+ * Simulation"). Sampling and density follow the energies down to a leaf, which is uniform
+ * Records only add to energies, atomically, so threads can record into the same tree
+ */
+class DTree {
+public:
+    DTree() : m_nodes(1) {};
+    DTree(const DTree &other) { *this = other; };
+    DTree& operator=(const DTree &other) {
+        m_nodes = other.m_nodes;
+        m_weight.store(other.m_weight.load());
+        return *this;
+    };
+
+    float Total() const;
+    float Weight() const { return m_weight.load(std::memory_order_relaxed); };
+    float Pdf(float u, float v) const;
+    void Sample(float u1, float u2, float &u, float &v) const;
+    void Record(float u, float v, float value);
+    DTree Refined(float threshold, int maxDepth) const;
+    void Reset();
+    void Scale(float s);
+
+private:
+    struct Node {
+        std::atomic<float> Sum[4];
+        uint32_t Child[4] = {0, 0, 0, 0}; // Zero for a leaf, the root is never a child
+
+        Node() { for (auto &s : Sum) s.store(0.0f, std::memory_order_relaxed); };
+        Node(const Node &other) { *this = other; };
+        Node& operator=(const Node &other) {
+            for (int q = 0; q < 4; ++q) {
+                Sum[q].store(other.Sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                Child[q] = other.Child[q];
+            }
+            return *this;
+        };
+        float Total() const {
+            return Sum[0].load(std::memory_order_relaxed) + Sum[1].load(std::memory_order_relaxed)
+                 + Sum[2].load(std::memory_order_relaxed) + Sum[3].load(std::memory_order_relaxed);
+        };
+    };
+
+    // Quadrant of a point in a node, x half in bit 0 and y half in bit 1
+    static int Quadrant(float &u, float &v) {
+        int q = 0;
+        if (u >= 0.5f) { q |= 1; u -= 0.5f; }
+        if (v >= 0.5f) { q |= 2; v -= 0.5f; }
+        u *= 2.0f;
+        v *= 2.0f;
+        return q;
+    }
+
+    std::vector<Node> m_nodes;
+    std::atomic<float> m_weight{0.0f};
+};
+
+float DTree::Total() const {
+    return m_nodes[0].Total();
+}
+
+/*
+ * Density on the unit square, uniform when nothing has been recorded
+ */
+float DTree::Pdf(float u, float v) const {
+    float pdf = 1.0f;
+    uint32_t node = 0;
+    while (true) {
+        const Node &n = m_nodes[node];
+        float total = n.Total();
+        if (total <= 0.0f) return pdf;
+        int q = Quadrant(u, v);
+        pdf *= 4.0f * n.Sum[q].load(std::memory_order_relaxed) / total;
+        if (!n.Child[q]) return pdf;
+        node = n.Child[q];
+    }
+}
+
+/*
+ * Pick rows then columns by their energy, reusing the random numbers all the way down
+ */
+void DTree::Sample(float u1, float u2, float &u, float &v) const {
+    float x = 0.0f, y = 0.0f, size = 1.0f;
+    uint32_t node = 0;
+    while (true) {
+        const Node &n = m_nodes[node];
+        float s[4];
+        for (int q = 0; q < 4; ++q) s[q] = n.Sum[q].load(std::memory_order_relaxed);
+        float total = s[0] + s[1] + s[2] + s[3];
+        if (total <= 0.0f) break;
+
+        int row = 0;
+        float bottom = (s[0] + s[1]) / total;
+        if (u2 < bottom) {
+            u2 /= bottom;
+        } else {
+            row = 1;
+            u2 = (u2 - bottom) / (1.0f - bottom);
+        }
+        int column = 0;
+        float rowTotal = s[2*row] + s[2*row + 1];
+        float left = rowTotal > 0.0f ? s[2*row] / rowTotal : 0.5f;
+        if (u1 < left) {
+            u1 /= left;
+        } else {
+            column = 1;
+            u1 = (u1 - left) / (1.0f - left);
+        }
+        u1 = std::min(u1, 0.99999994f);
+        u2 = std::min(u2, 0.99999994f);
+
+        size *= 0.5f;
+        x += column * size;
+        y += row * size;
+        int q = column | (row << 1);
+        if (!n.Child[q]) break;
+        node = n.Child[q];
+    }
+    u = x + u1 * size;
+    v = y + u2 * size;
+}
+
+void DTree::Record(float u, float v, float value) {
+    Parallel::AtomicAdd(m_weight, 1.0f);
+    if (!(value > 0.0f) || !std::isfinite(value)) return;
+    uint32_t node = 0;
+    while (true) {
+        Node &n = m_nodes[node];
+        int q = Quadrant(u, v);
+        Parallel::AtomicAdd(n.Sum[q], value);
+        if (!n.Child[q]) return;
+        node = n.Child[q];
+    }
+}
+
+/*
+ * A tree shaped by this one's energy: quadrants holding more than threshold of the total are
+ * split, spreading their energy evenly over new children, and nodes holding less are merged
+ */
+DTree DTree::Refined(float threshold, int maxDepth) const {
+    DTree next;
+    const float total = Total();
+    if (total <= 0.0f) return next;
+
+    struct Item {
+        uint32_t Node;
+        int Old; // Node of this tree covering the same square, or -1
+        float Sum[4];
+        int Depth;
+    };
+    std::vector<Item> stack;
+    Item root = {0, 0, {0, 0, 0, 0}, 1};
+    for (int q = 0; q < 4; ++q) root.Sum[q] = m_nodes[0].Sum[q].load(std::memory_order_relaxed);
+    stack.push_back(root);
+
+    while (!stack.empty()) {
+        Item item = stack.back();
+        stack.pop_back();
+        for (int q = 0; q < 4; ++q) {
+            next.m_nodes[item.Node].Sum[q].store(item.Sum[q], std::memory_order_relaxed);
+            if (item.Sum[q] / total <= threshold || item.Depth >= maxDepth) continue;
+
+            Item child = {uint32_t(next.m_nodes.size()), -1, {0, 0, 0, 0}, item.Depth + 1};
+            int old = item.Old >= 0 ? int(m_nodes[item.Old].Child[q]) : 0;
+            if (old) {
+                child.Old = old;
+                for (int c = 0; c < 4; ++c) child.Sum[c] = m_nodes[old].Sum[c].load(std::memory_order_relaxed);
+            } else {
+                for (int c = 0; c < 4; ++c) child.Sum[c] = 0.25f * item.Sum[q];
+            }
+            next.m_nodes.emplace_back();
+            next.m_nodes[item.Node].Child[q] = child.Node;
+            stack.push_back(child);
+        }
+    }
+    return next;
+}
+
+// Zero every energy and the sample count, keeping the shape
+void DTree::Reset() {
+    for (auto &n : m_nodes)
+        for (auto &s : n.Sum) s.store(0.0f, std::memory_order_relaxed);
+    m_weight.store(0.0f);
+}
+
+// Scale the sample count, as when a spatial split hands half the samples to each side
+void DTree::Scale(float s) {
+    m_weight.store(m_weight.load() * s);
+}
+
+/*
+ * SDTree
+ * Binary tree over space whose leaves hold a pair of directional trees: one learned in earlier
+ * iterations to sample from, and one recording this iteration's samples
+ * The shape only changes in Refine, between iterations, so during one lookups need no locks
+ */
+class SDTree {
+public:
+    void Reset(const Point3 &lo, const Point3 &hi);
+    bool Guides(const Point3 &p) const { return m_leaves[LeafOf(p)].Sampling.Total() > 0.0f; };
+    Dir3 Sample(const Point3 &p, float u1, float u2) const;
+    float Pdf(const Point3 &p, const Dir3 &d) const;
+    void Record(const Point3 &p, const Dir3 &d, float value);
+    void Refine(float splitThreshold, float energyThreshold, int maxDepth);
+    int Leaves() const { return m_leaves.size(); };
+
+private:
+    struct Node {
+        int Axis = 0;
+        float Split = 0.0f;
+        uint32_t Child[2] = {0, 0};
+        int Leaf = 0; // Leaf index when there are no children
+    };
+    struct Leaf {
+        DTree Sampling;
+        DTree Building;
+    };
+
+    int LeafOf(const Point3 &p) const;
+    void Split(uint32_t node, const Point3 &lo, const Point3 &hi, float threshold, int depth);
+
+    // Cylindrical map from the sphere to the unit square, which preserves area
+    static void ToSquare(const Dir3 &d, float &u, float &v) {
+        u = std::min(std::max(0.5f * (d.z() + 1.0f), 0.0f), 0.99999994f);
+        float phi = std::atan2(d.y(), d.x());
+        if (phi < 0.0f) phi += 2.0f * MonteCarlo::PI;
+        v = std::min(phi / (2.0f * MonteCarlo::PI), 0.99999994f);
+    }
+    static Dir3 FromSquare(float u, float v) {
+        float cosTheta = 2.0f * u - 1.0f;
+        float sinTheta = std::sqrt(std::max(0.0f, 1.0f - cosTheta * cosTheta));
+        float phi = 2.0f * MonteCarlo::PI * v;
+        return Dir3(sinTheta * std::cos(phi), sinTheta * std::sin(phi), cosTheta);
+    }
+
+    std::vector<Node> m_nodes;
+    std::vector<Leaf> m_leaves;
+    Point3 m_lo, m_hi;
+};
+
+void SDTree::Reset(const Point3 &lo, const Point3 &hi) {
+    m_lo = lo;
+    m_hi = hi;
+    m_nodes.assign(1, Node());
+    m_leaves.assign(1, Leaf());
+}
+
+int SDTree::LeafOf(const Point3 &p) const {
+    uint32_t node = 0;
+    while (m_nodes[node].Child[0]) {
+        const Node &n = m_nodes[node];
+        float x = n.Axis == 0 ? p.x() : (n.Axis == 1 ? p.y() : p.z());
+        node = n.Child[x < n.Split ? 0 : 1];
+    }
+    return m_nodes[node].Leaf;
+}
+
+Dir3 SDTree::Sample(const Point3 &p, float u1, float u2) const {
+    float u, v;
+    m_leaves[LeafOf(p)].Sampling.Sample(u1, u2, u, v);
+    return FromSquare(u, v);
+}
+
+// Density per unit solid angle, the square's 1 spread over the sphere's 4 pi
+float SDTree::Pdf(const Point3 &p, const Dir3 &d) const {
+    float u, v;
+    ToSquare(d, u, v);
+    return m_leaves[LeafOf(p)].Sampling.Pdf(u, v) / (4.0f * MonteCarlo::PI);
+}
+
+void SDTree::Record(const Point3 &p, const Dir3 &d, float value) {
+    float u, v;
+    ToSquare(d, u, v);
+    m_leaves[LeafOf(p)].Building.Record(u, v, value);
+}
+
+/*
+ * End of an iteration. Leaves that recorded more than splitThreshold samples are halved, each
+ * half keeping a copy of the directional trees. Then every leaf samples from what it recorded,
+ * reshaped by energyThreshold, and starts recording afresh
+ */
+void SDTree::Refine(float splitThreshold, float energyThreshold, int maxDepth) {
+    Split(0, m_lo, m_hi, splitThreshold, 0);
+    for (auto &leaf : m_leaves) {
+        leaf.Sampling = leaf.Building.Refined(energyThreshold, maxDepth);
+        leaf.Building = leaf.Sampling;
+        leaf.Building.Reset();
+    }
+}
+
+void SDTree::Split(uint32_t node, const Point3 &lo, const Point3 &hi, float threshold, int depth) {
+    if (m_nodes[node].Child[0]) {
+        const Node n = m_nodes[node];
+        Point3 midHi = hi, midLo = lo;
+        if (n.Axis == 0) { midHi = Point3(n.Split, hi.y(), hi.z()); midLo = Point3(n.Split, lo.y(), lo.z()); }
+        if (n.Axis == 1) { midHi = Point3(hi.x(), n.Split, hi.z()); midLo = Point3(lo.x(), n.Split, lo.z()); }
+        if (n.Axis == 2) { midHi = Point3(hi.x(), hi.y(), n.Split); midLo = Point3(lo.x(), lo.y(), n.Split); }
+        Split(n.Child[0], lo, midHi, threshold, depth + 1);
+        Split(n.Child[1], midLo, hi, threshold, depth + 1);
+        return;
+    }
+
+    const int leaf = m_nodes[node].Leaf;
+    if (m_leaves[leaf].Building.Weight() <= threshold || depth >= 48) return;
+
+    // Halve along the longest side, each side taking half of the samples
+    Dir3 extent = hi - lo;
+    int axis = 0;
+    if (extent.y() > extent.x()) axis = 1;
+    if (extent.z() > (axis == 0 ? extent.x() : extent.y())) axis = 2;
+    float split = 0.5f * ((axis == 0 ? lo.x() : (axis == 1 ? lo.y() : lo.z())) + (axis == 0 ? hi.x() : (axis == 1 ? hi.y() : hi.z())));
+
+    m_leaves[leaf].Building.Scale(0.5f);
+    m_leaves.push_back(m_leaves[leaf]);
+    Node left, right;
+    left.Leaf = leaf;
+    right.Leaf = m_leaves.size() - 1;
+    m_nodes[node].Axis = axis;
+    m_nodes[node].Split = split;
+    m_nodes[node].Child[0] = m_nodes.size();
+    m_nodes[node].Child[1] = m_nodes.size() + 1;
+    m_nodes.push_back(left);
+    m_nodes.push_back(right);
+    Split(node, lo, hi, threshold, depth);
+}
+
+#endif
@@ -1,6 +1,9 @@
 #ifndef SIMPLETRIANGLE_H
 #define SIMPLETRIANGLE_H
 
+#include <cmath>
+#include <algorithm>
+
 #include "object.h"
 #include "vec3.h"
 
@@ -29,18 +32,41 @@ public:
     }
 
     virtual bool Intersects(const Ray& r, float min, float max, Surfel& s) override;
+    virtual float Area() const override { return 0.5f * Cross(m_v1-m_v0, m_v2-m_v0).Length(); };
+    virtual Point3 SamplePoint(float u, float v, Dir3& n) const override {
+        // Square root warp keeps the barycentrics uniform over the triangle
+        float su = std::sqrt(u);
+        n = m_n;
+        return (1.0f - su) * m_v0 + (su * (1.0f - v)) * m_v1 + (su * v) * m_v2;
+    };
+    virtual void Bounds(Point3& lo, Point3& hi) const override {
+        lo = Point3(std::min({m_v0.x(), m_v1.x(), m_v2.x()}), std::min({m_v0.y(), m_v1.y(), m_v2.y()}), std::min({m_v0.z(), m_v1.z(), m_v2.z()}));
+        hi = Point3(std::max({m_v0.x(), m_v1.x(), m_v2.x()}), std::max({m_v0.y(), m_v1.y(), m_v2.y()}), std::max({m_v0.z(), m_v1.z(), m_v2.z()}));
+    };
+    virtual float NormalCone(Dir3& axis) const override { axis = m_n; return 1.0f; };
+    virtual bool Tessellate(std::vector<Point3>& corners) const override {
+        corners.insert(corners.end(), {m_v0, m_v1, m_v2});
+        return true;
+    };
 
     /*
      * Compute Alpha, Beta, Gamma for Barycentric interpolation
      */
     void ComputeABG(Point3 p) {
+        Barycentrics(p, m_alpha, m_beta, m_gamma);
+    }
+
+    /*
+     * Barycentric coordinates of p without storing them, safe to call from several threads
+     */
+    void Barycentrics(Point3 p, float &alpha, float &beta, float &gamma) const {
         Vec3 b2 = p - m_v0;
         float d20 = Dot(b2, b0);
         float d21 = Dot(b2, b1);
         float denom = d00 * d11 - d01 * d01;
-        m_beta = (d11 * d20 - d01 * d21) / denom;
-        m_gamma = (d00 * d21 - d01 * d20) / denom;
-        m_alpha = 1.0f - m_gamma - m_beta;
+        beta = (d11 * d20 - d01 * d21) / denom;
+        gamma = (d00 * d21 - d01 * d20) / denom;
+        alpha = 1.0f - gamma - beta;
     }
 
     /*
@@ -103,15 +129,13 @@ bool SimpleTriangle::Intersects(const Ray& r, float min, float max, Surfel& s) {
     // std::cerr << Q << std::endl;
     // std::cerr << m_n << std::endl;
 
-    ComputeABG(Q);
-
     s.At = t;
     s.Point = Q;
     // s.Normal = m_alpha*m_n + m_beta*m_n + m_gamma*m_n;
     s.Normal = m_n;
 
-    // Transfer material properties
-    TransferMaterialProperties(s);
+    // The material is looked up by id once the closest hit is known
+    s.MaterialId = MaterialId;
 
     return true;
 }
@@ -2,7 +2,9 @@
 #define SPHERE_H
 
 #include <cmath>
+#include <algorithm>
 
+#include "montecarlo.h"
 #include "object.h"
 #include "vec3.h"
 
@@ -12,7 +14,20 @@ public:
     Sphere(const Point3 c, const float r) : m_c(c), m_r(r) {};
 
     virtual bool Intersects(const Ray& r, float min, float max, Surfel& s) override;
-    // virtual void TransferMaterialProperties(Surfel& s) const override;
+    virtual float Area() const override { return 4.0f * MonteCarlo::PI * m_r * m_r; };
+    virtual Point3 SamplePoint(float u, float v, Dir3& n) const override {
+        float z = 1.0f - 2.0f * u;
+        float r = std::sqrt(std::max(0.0f, 1.0f - z * z));
+        float phi = 2.0f * MonteCarlo::PI * v;
+        n = Dir3(r * std::cos(phi), r * std::sin(phi), z);
+        return m_c + m_r * n;
+    };
+    virtual void Bounds(Point3& lo, Point3& hi) const override {
+        lo = m_c - Vec3(m_r, m_r, m_r);
+        hi = m_c + Vec3(m_r, m_r, m_r);
+    };
+    virtual bool Tessellate(std::vector<Point3>& corners) const override;
+    virtual bool TessellationIsExact() const override { return false; };
 
     Point3 Centre() const { return m_c; };
     float Radius() const { return m_r; };
@@ -44,10 +59,36 @@ bool Sphere::Intersects(const Ray& r, float min, float max, Surfel& s) {
     s.Point = r.At(s.At);
     s.Normal = (s.Point - m_c) / m_r;
 
-    // Transfer material properties
-    TransferMaterialProperties(s);
+    // The material is looked up by id once the closest hit is known
+    s.MaterialId = MaterialId;
 
     return true;
 }
 
+/*
+ * Latitude and longitude mesh, pushed out from the centre just enough that every face lies
+ * outside the sphere: a face's corners are within half a cell diagonal of its middle, so its
+ * plane is at least cos of that angle times the pushed out radius from the centre
+ */
+bool Sphere::Tessellate(std::vector<Point3>& corners) const {
+    const int slices = 64, stacks = 32;
+    const float dPhi = 2.0f * MonteCarlo::PI / slices, dTheta = MonteCarlo::PI / stacks;
+    const float r = m_r / std::cos(0.5f * std::sqrt(dPhi * dPhi + dTheta * dTheta));
+
+    auto at = [&](int i, int j) {
+        float theta = j * dTheta, phi = i * dPhi;
+        return m_c + r * Dir3(std::sin(theta) * std::cos(phi), std::cos(theta), std::sin(theta) * std::sin(phi));
+    };
+    for (int j = 0; j < stacks; ++j) {
+        for (int i = 0; i < slices; ++i) {
+            // The cells at the poles lose a corner, leaving one triangle
+            if (j > 0)
+                corners.insert(corners.end(), {at(i, j), at(i + 1, j), at(i + 1, j + 1)});
+            if (j < stacks - 1)
+                corners.insert(corners.end(), {at(i, j), at(i + 1, j + 1), at(i, j + 1)});
+        }
+    }
+    return true;
+}
+
 #endif
\ No newline at end of file
@@ -0,0 +1,40 @@
+#ifndef SPLATBUFFER_H
+#define SPLATBUFFER_H
+
+#include <atomic>
+#include <vector>
+
+#include "colour3.h"
+#include "parallel.h"
+
+/*
+ * SplatBuffer
+ * Float image that any thread may add to at any pixel without locks, for contributions that land
+ * on a pixel other than the one being sampled, like light subpaths seen by the camera
+ * Values are not clamped, so many small splats add up correctly
+ */
+class SplatBuffer {
+public:
+    void Reset(int pixels) {
+        m_values = std::vector<std::atomic<float>>(3 * pixels);
+        for (auto &v : m_values) v.store(0.0f, std::memory_order_relaxed);
+    }
+
+    void Add(int pixel, const Colour3 &c, float scale) {
+        Parallel::AtomicAdd(m_values[3*pixel], c.r() * scale);
+        Parallel::AtomicAdd(m_values[3*pixel+1], c.g() * scale);
+        Parallel::AtomicAdd(m_values[3*pixel+2], c.b() * scale);
+    }
+
+    // Only once every thread adding has finished
+    Colour3 Get(int pixel, float scale) const {
+        return Colour3(m_values[3*pixel].load(std::memory_order_relaxed) * scale,
+                       m_values[3*pixel+1].load(std::memory_order_relaxed) * scale,
+                       m_values[3*pixel+2].load(std::memory_order_relaxed) * scale);
+    }
+
+private:
+    std::vector<std::atomic<float>> m_values;
+};
+
+#endif
@@ -4,27 +4,47 @@
 #include <memory>
 #include <cmath>
 #include <algorithm>
+#include <cstdint>
 
 #include "object.h"
 #include "vec3.h"
 #include "colour3.h"
+#include "montecarlo.h"
 
 class Surfel {
 public:
     Surfel() {};
-    float BRDF(Dir3 in, Dir3 out);
+    // With glossyOnly set these cover the glossy lobe alone, for when the Lambert lobe is
+    // accounted for elsewhere
+    float BRDF(Dir3 out, Dir3 in, bool glossyOnly = false) const;
+    float PDF(Dir3 out, Dir3 in, bool glossyOnly = false) const;
+    Dir3 SampleBRDF(Dir3 out, float u0, float u1, float u2, float &pdf, bool glossyOnly = false);
     Colour3 BRDF3(Dir3 out, Dir3 in);
-    Colour3 Diffuse3(Dir3 in) {
+    // Make Normal unit length and turn it to the side out leaves from
+    void FaceForward(Dir3 out) {
+        Normal = Unit(Normal);
+        if (Dot(Normal, out) < 0.0f)
+            Normal = -Normal;
+    }
+    // Share of the Lambert and glossy albedos the lobes reflect, so that together they never
+    // reflect more light than they receive
+    float LobeScale() const {
+        return 1.0f / std::max(LambertAlbedo + GlossyAlbedo, 1.0f);
+    }
+    Colour3 Diffuse3(Dir3 in) const {
         return std::max(Dot(Normal, in), 0.0f) * Diffuse;
     }
-    Colour3 Specular3(Dir3 out, Dir3 in) {
+    Colour3 Specular3(Dir3 out, Dir3 in) const {
         return std::pow(std::max(Dot((out+in)/2.0f, Normal), 0.0f), Exponent) * Specular;
     }
 
 public:
     float At;
+    int ObjectId = -1;
+    uint16_t MaterialId = 0;
     Point3 Point;
     Dir3 Normal;
+    // Copied from the MaterialTable by ObjectList::ResolveMaterial
     Colour3 Emission;
     float AmbientAlbedo;
     float LambertAlbedo;
@@ -37,10 +57,63 @@ public:
     Colour3 Specular;
 };
 
-float Surfel::BRDF(Dir3 out, Dir3 in) {
-    float L = Dot(Normal, in);
-    float G = std::pow(Dot(Normal, (out + in)/2.0f), Exponent);
-    return (L * LambertAlbedo + G * GlossyAlbedo);
+/*
+ * Normalised Blinn-Phong reflectance including the cosine of the incoming direction
+ * The albedos are scaled down together by LobeScale where they sum to more than one
+ * Assumes vectors already normalised
+ */
+float Surfel::BRDF(Dir3 out, Dir3 in, bool glossyOnly) const {
+    float cosIn = Dot(Normal, in);
+    if (cosIn <= 0.0f) return 0.0f;
+    float L = glossyOnly ? 0.0f : LambertAlbedo / MonteCarlo::PI;
+    float G = GlossyAlbedo * (Exponent + 8.0f) / (8.0f * MonteCarlo::PI)
+              * std::pow(std::max(Dot(Normal, Unit(out + in)), 0.0f), Exponent);
+    return cosIn * (L + G) * LobeScale();
+}
+
+/*
+ * Density of SampleBRDF choosing in, given out
+ * A mix of the cosine lobe for Lambert and the half vector lobe for the glossy term, chosen in
+ * proportion to their albedos, which LobeScale leaves unchanged
+ */
+float Surfel::PDF(Dir3 out, Dir3 in, bool glossyOnly) const {
+    float total = LambertAlbedo + GlossyAlbedo;
+    if (total <= 0.0f || (glossyOnly && GlossyAlbedo <= 0.0f)) return 0.0f;
+    float diffuseChance = glossyOnly ? 0.0f : LambertAlbedo / total;
+
+    Dir3 h = Unit(out + in);
+    float cosOutH = std::abs(Dot(out, h));
+    float glossyPdf = 0.0f;
+    if (cosOutH > 0.0f)
+        glossyPdf = MonteCarlo::PowerCosineLobePdf(Normal, Exponent, h) / (4.0f * cosOutH);
+
+    return diffuseChance * MonteCarlo::CosineHemispherePdf(Normal, in)
+           + (1.0f - diffuseChance) * glossyPdf;
+}
+
+/*
+ * Importance sample an incoming direction for out
+ * u0 picks the lobe, u1 and u2 place the direction within it
+ * Returns the mixture pdf in pdf, which is zero if the direction is below the surface
+ */
+Dir3 Surfel::SampleBRDF(Dir3 out, float u0, float u1, float u2, float &pdf, bool glossyOnly) {
+    float total = LambertAlbedo + GlossyAlbedo;
+    pdf = 0.0f;
+    if (total <= 0.0f || (glossyOnly && GlossyAlbedo <= 0.0f)) return Normal;
+
+    Dir3 in;
+    float lobePdf;
+    if (!glossyOnly && u0 < LambertAlbedo / total) {
+        in = MonteCarlo::CosineHemisphere(Normal, u1, u2, lobePdf);
+    } else {
+        // Sample the half vector then reflect out about it
+        Dir3 h = MonteCarlo::PowerCosineLobe(Normal, Exponent, u1, u2, lobePdf);
+        in = 2.0f * Dot(out, h) * h - out;
+    }
+
+    if (Dot(Normal, in) <= 0.0f) return in;
+    pdf = PDF(out, in, glossyOnly);
+    return in;
 }
 
 /*
@@ -0,0 +1,179 @@
+#ifndef TILEDTIFF_H
+#define TILEDTIFF_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/*
+ * TiledTiff
+ * An 8 bit RGB TIFF stored as square uncompressed tiles, written a tile at a time in any order
+ * Every tile takes the same room, so where each goes is known from the start: the header and the
+ * index of tile offsets are written on Open, and each tile lands straight in its place. Files
+ * past 4 GB are written as BigTIFF, which has 64 bit offsets
+ */
+class TiledTiff {
+public:
+    TiledTiff() {};
+    TiledTiff(const TiledTiff &) = delete;
+    TiledTiff &operator=(const TiledTiff &) = delete;
+    ~TiledTiff() { Close(); };
+
+    // Create the file for an image, tiles being a multiple of 16 pixels across as TIFF asks
+    // Returns false on failure
+    bool Open(const std::string &path, uint32_t width, uint32_t height, uint32_t tileSize);
+    // Returns false when some write failed
+    bool Close();
+
+    uint32_t Tiles() const { return m_across * m_down; };
+    uint32_t TileSize() const { return m_tile; };
+
+    // Pixel columns [x0,x1) and rows [y0,y1) of a tile
+    void TileBounds(uint32_t tile, uint32_t &x0, uint32_t &y0, uint32_t &x1, uint32_t &y1) const;
+
+    /*
+     * Write one tile from TileSize rows of TileSize RGB pixels. Past the edge of the image the
+     * tile is padding, which readers ignore. Safe to call from several threads at once
+     */
+    bool WriteTile(uint32_t tile, const uint8_t *rgb);
+
+private:
+    uint64_t TileBytes() const { return uint64_t(m_tile) * m_tile * 3; };
+
+    int m_fd = -1;
+    std::atomic<bool> m_failed{false};
+    uint32_t m_width = 0, m_height = 0;
+    uint32_t m_tile = 0, m_across = 0, m_down = 0;
+    uint64_t m_data = 0; // Offset of the first tile
+};
+
+bool TiledTiff::Open(const std::string &path, uint32_t width, uint32_t height, uint32_t tileSize) {
+    Close();
+    m_width = width;
+    m_height = height;
+    m_tile = std::max(16u, (tileSize + 15) / 16 * 16);
+    m_across = (width + m_tile - 1) / m_tile;
+    m_down = (height + m_tile - 1) / m_tile;
+
+    // Entries of the one directory, in tag order, each with its type and values
+    enum Type { Short = 3, Long = 4, Long8 = 16 };
+    struct Entry {
+        uint16_t Tag;
+        Type Kind;
+        std::vector<uint64_t> Values;
+    };
+    const uint64_t tiles = Tiles();
+    const bool big = 1024 + 12 * tiles + tiles * TileBytes() > 0xffffffffull;
+    std::vector<Entry> entries = {
+        {256, Long, {width}},
+        {257, Long, {height}},
+        {258, Short, {8, 8, 8}},    // Bits per sample
+        {259, Short, {1}},          // No compression
+        {262, Short, {2}},          // RGB
+        {277, Short, {3}},          // Samples per pixel
+        {284, Short, {1}},          // Samples interleaved
+        {322, Long, {m_tile}},
+        {323, Long, {m_tile}},
+        {324, big ? Long8 : Long, std::vector<uint64_t>(tiles)}, // Tile offsets, filled below
+        {325, Long, std::vector<uint64_t>(tiles, TileBytes())},
+    };
+
+    // Header, directory, the values too long to sit in their entries, then the tiles
+    const uint64_t headerSize = big ? 16 : 8;
+    const uint64_t entrySize = big ? 20 : 12, inlineSize = big ? 8 : 4;
+    const uint64_t directorySize = (big ? 8 : 2) + entries.size() * entrySize + (big ? 8 : 4);
+    auto size = [](Type t) { return t == Short ? 2u : t == Long ? 4u : 8u; };
+    uint64_t extra = headerSize + directorySize;
+    for (const auto &e : entries)
+        if (e.Values.size() * size(e.Kind) > inlineSize)
+            extra += e.Values.size() * size(e.Kind);
+    m_data = (extra + 15) / 16 * 16;
+    for (uint64_t t = 0; t < tiles; ++t)
+        entries[9].Values[t] = m_data + t * TileBytes();
+
+    std::string out;
+    auto put = [&out](uint64_t v, int bytes) {
+        for (int b = 0; b < bytes; ++b)
+            out += char(v >> (8 * b));
+    };
+    out += "II";
+    if (big) {
+        put(43, 2);
+        put(8, 2);
+        put(0, 2);
+        put(headerSize, 8);
+        put(entries.size(), 8);
+    } else {
+        put(42, 2);
+        put(headerSize, 4);
+        put(entries.size(), 2);
+    }
+    std::string values;
+    uint64_t next = headerSize + directorySize;
+    for (const auto &e : entries) {
+        put(e.Tag, 2);
+        put(e.Kind, 2);
+        put(e.Values.size(), big ? 8 : 4);
+        const uint64_t bytes = e.Values.size() * size(e.Kind);
+        if (bytes <= inlineSize) {
+            for (uint64_t v : e.Values)
+                put(v, size(e.Kind));
+            put(0, inlineSize - bytes);
+        } else {
+            put(next, inlineSize);
+            next += bytes;
+            out.swap(values);
+            for (uint64_t v : e.Values)
+                put(v, size(e.Kind));
+            out.swap(values);
+        }
+    }
+    put(0, big ? 8 : 4); // No further directory
+    out += values;
+    out.resize(m_data, '\0');
+
+    m_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (m_fd < 0) return false;
+    m_failed = false;
+    if (pwrite(m_fd, out.data(), out.size(), 0) != ssize_t(out.size()) ||
+        ftruncate(m_fd, m_data + tiles * TileBytes()) != 0) {
+        Close();
+        return false;
+    }
+    return true;
+}
+
+bool TiledTiff::Close() {
+    bool ok = !m_failed;
+    if (m_fd >= 0)
+        ok = close(m_fd) == 0 && ok;
+    m_fd = -1;
+    m_failed = false;
+    return ok;
+}
+
+void TiledTiff::TileBounds(uint32_t tile, uint32_t &x0, uint32_t &y0, uint32_t &x1, uint32_t &y1) const {
+    x0 = (tile % m_across) * m_tile;
+    y0 = (tile / m_across) * m_tile;
+    x1 = std::min(x0 + m_tile, m_width);
+    y1 = std::min(y0 + m_tile, m_height);
+}
+
+bool TiledTiff::WriteTile(uint32_t tile, const uint8_t *rgb) {
+    const uint64_t bytes = TileBytes();
+    uint64_t done = 0;
+    while (m_fd >= 0 && done < bytes) {
+        ssize_t n = pwrite(m_fd, rgb + done, bytes - done, m_data + tile * bytes + done);
+        if (n <= 0) break;
+        done += n;
+    }
+    if (done < bytes) m_failed = true;
+    return done == bytes;
+}
+
+#endif
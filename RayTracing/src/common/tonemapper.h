@@ -0,0 +1,88 @@
+#ifndef TONEMAPPER_H
+#define TONEMAPPER_H
+
+#include <cfloat>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/*
+ * ToneMapper
+ * Turns linear radiance into 8 bit display values, once for a whole image as it is written out
+ * Each value is scaled by Exposure, clamped to [0, FLT_MAX] so infinity counts as the brightest
+ * value, compressed by Reinhard's curve x / (1 + x) when Reinhard is on, clamped to [0,1] and
+ * raised to 1 / Gamma. Values are treated alike whatever channel they
+ * belong to, so a buffer is converted four values to an SSE register regardless of its layout
+ */
+class ToneMapper {
+public:
+    float Exposure = 1.0f;
+    bool Reinhard = true;
+    float Gamma = 1.0f;
+
+    // Bytes for count values. NaNs come out black
+    void Convert(const float *in, size_t count, uint8_t *out) const;
+
+private:
+    // Steps of the gamma curve from [0,1] to bytes, fine enough for its steep start
+    static const int CurveSize = 1 << 16;
+};
+
+/*
+ * Gamma has no SSE form, so unless it is 1 the curve is tabulated and the register only finds
+ * each value's entry
+ */
+void ToneMapper::Convert(const float *in, size_t count, uint8_t *out) const {
+    const bool table = Gamma != 1.0f;
+    std::vector<uint8_t> curve;
+    if (table) {
+        curve.resize(CurveSize + 1);
+        for (int i = 0; i <= CurveSize; ++i)
+            curve[i] = uint8_t(255.999f * std::pow(float(i) / CurveSize, 1.0f / Gamma));
+    }
+    // Table entries are rounded to, bytes truncated to as colours always were
+    const float scale = table ? float(CurveSize) : 255.999f;
+    const float offset = table ? 0.5f : 0.0f;
+
+    size_t k = 0;
+#if defined(__SSE2__)
+    const __m128 exposure = _mm_set1_ps(Exposure), one = _mm_set1_ps(1.0f), zero = _mm_setzero_ps();
+    const __m128 largest = _mm_set1_ps(FLT_MAX);
+    const __m128 s = _mm_set1_ps(scale), o = _mm_set1_ps(offset);
+    for (; k + 4 <= count; k += 4) {
+        __m128 x = _mm_mul_ps(_mm_loadu_ps(in + k), exposure);
+        // max gives its second operand for NaN
+        x = _mm_min_ps(_mm_max_ps(x, zero), largest);
+        if (Reinhard)
+            x = _mm_div_ps(x, _mm_add_ps(one, x));
+        x = _mm_min_ps(x, one);
+        __m128i q = _mm_cvttps_epi32(_mm_add_ps(_mm_mul_ps(x, s), o));
+        if (table) {
+            alignas(16) int32_t index[4];
+            _mm_store_si128(reinterpret_cast<__m128i*>(index), q);
+            for (int j = 0; j < 4; ++j)
+                out[k + j] = curve[index[j]];
+        } else {
+            q = _mm_packs_epi32(q, q);
+            q = _mm_packus_epi16(q, q);
+            int32_t bytes = _mm_cvtsi128_si32(q);
+            std::memcpy(out + k, &bytes, 4);
+        }
+    }
+#endif
+    for (; k < count; ++k) {
+        float x = in[k] * Exposure;
+        x = x > 0.0f ? std::fmin(x, FLT_MAX) : 0.0f;
+        if (Reinhard)
+            x = x / (1.0f + x);
+        x = std::fmin(x, 1.0f);
+        int q = int(x * scale + offset);
+        out[k] = table ? curve[q] : uint8_t(q);
+    }
+}
+
+#endif
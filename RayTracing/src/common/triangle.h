@@ -2,6 +2,8 @@
 #define TRIANGLE_H
 
 #include <array>
+#include <algorithm>
+#include <cmath>
 
 #include "object.h"
 #include "vec3.h"
@@ -42,19 +44,50 @@ public:
     }
 
     virtual bool Intersects(const Ray& r, float min, float max, Surfel& s) override;
+    virtual float Area() const override { return 0.5f * Cross(m_p[1]-m_p[0], m_p[2]-m_p[0]).Length(); };
+    virtual Point3 SamplePoint(float u, float v, Dir3& n) const override {
+        // Square root warp keeps the barycentrics uniform over the triangle
+        float su = std::sqrt(u);
+        n = m_surfaceNormal;
+        return (1.0f - su) * m_p[0] + (su * (1.0f - v)) * m_p[1] + (su * v) * m_p[2];
+    };
+    virtual void Bounds(Point3& lo, Point3& hi) const override {
+        lo = Point3(std::min({m_p[0].x(), m_p[1].x(), m_p[2].x()}), std::min({m_p[0].y(), m_p[1].y(), m_p[2].y()}), std::min({m_p[0].z(), m_p[1].z(), m_p[2].z()}));
+        hi = Point3(std::max({m_p[0].x(), m_p[1].x(), m_p[2].x()}), std::max({m_p[0].y(), m_p[1].y(), m_p[2].y()}), std::max({m_p[0].z(), m_p[1].z(), m_p[2].z()}));
+    };
+    virtual float NormalCone(Dir3& axis) const override {
+        // Cone around the vertex normals, which shading uses
+        Dir3 sum = m_n[0] + m_n[1] + m_n[2];
+        axis = sum.LengthSquared() > 0.0f ? Unit(sum) : m_surfaceNormal;
+        float cosCone = 1.0f;
+        for (const auto &n : m_n)
+            cosCone = std::min(cosCone, n.LengthSquared() > 0.0f ? Dot(axis, Unit(n)) : -1.0f);
+        return cosCone;
+    };
+    virtual bool Tessellate(std::vector<Point3>& corners) const override {
+        corners.insert(corners.end(), m_p.begin(), m_p.end());
+        return true;
+    };
 
 
     /*
      * Compute Alpha, Beta, Gamma for Barycentric interpolation
      */
     void ComputeABG(Point3 p) {
+        Barycentrics(p, m_alpha, m_beta, m_gamma);
+    }
+
+    /*
+     * Barycentric coordinates of p without storing them, safe to call from several threads
+     */
+    void Barycentrics(Point3 p, float &alpha, float &beta, float &gamma) const {
         Vec3 b2 = p - m_p[0];
         float d20 = Dot(b2, b0);
         float d21 = Dot(b2, b1);
         float denom = d00 * d11 - d01 * d01;
-        m_beta = (d11 * d20 - d01 * d21) / denom;
-        m_gamma = (d00 * d21 - d01 * d20) / denom;
-        m_alpha = 1.0f - m_gamma - m_beta;
+        beta = (d11 * d20 - d01 * d21) / denom;
+        gamma = (d00 * d21 - d01 * d20) / denom;
+        alpha = 1.0f - gamma - beta;
     }
 
     /*
@@ -138,14 +171,16 @@ bool Triangle::Intersects(const Ray& r, float min, float max, Surfel& s) {
     // Does point Q lie inside the triangle
     if (!Inside(Q)) return false;
 
-    ComputeABG(Q);
+    // Rays may be traced from several threads, so keep the coordinates local
+    float alpha, beta, gamma;
+    Barycentrics(Q, alpha, beta, gamma);
 
     s.At = t;
     s.Point = Q;
-    s.Normal = m_alpha*m_n[0] + m_beta*m_n[1] + m_gamma*m_n[2];
+    s.Normal = alpha*m_n[0] + beta*m_n[1] + gamma*m_n[2];
 
-    // Transfer material properties
-    TransferMaterialProperties(s);
+    // The material is looked up by id once the closest hit is known
+    s.MaterialId = MaterialId;
 
     return true;
 }
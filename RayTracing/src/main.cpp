@@ -1,10 +1,14 @@
 #include <iostream>
 #include <limits>
+#include <set>
+#include <string>
+#include <vector>
 
 #include "common/vec3.h"
 #include "common/triangle.h"
 #include "common/objreader.h"
 #include "common/camera.h"
+#include "common/material.h"
 #include "common/object.h"
 #include "common/objectlist.h"
 #include "common/sphere.h"
@@ -12,17 +16,100 @@
 #include "common/image.h"
 #include "common/raytracer.h"
 #include "common/plane.h"
+#include "common/meshcache.h"
+#include "common/scenefile.h"
 
 int main (const int argc, const char *argv[]) {
 
-    // Read file
-    ObjReader obj("../models/cornellBox.obj");
+    // --checkpoint <file> saves progress as the render goes, --resume carries on from the file
+    // --output <file> writes the image there rather than to stdout, as PFM for a .pfm file, QOI
+    // for a .qoi file and as binary PPM otherwise; --plain keeps the text PPM. --stream <file>
+    // renders tile by tile into a tiled TIFF, never holding the whole image
+    // --scene <file> renders a scene file in place of the built in scene, and --batch <file>
+    // each scene file it lists. Any number of either render one after another in this process,
+    // each then with files of its own named after it: out.cornell.ppm for --output out.ppm and
+    // scene cornell.scene, likewise for --checkpoint, --stream and the scene's own output line,
+    // and cornell.ppm by default
+    std::string checkpoint, output, stream;
+    bool resume = false, plain = false;
+    std::vector<std::string> scenes;
+    for (int a = 1; a < argc; ++a) {
+        std::string arg = argv[a];
+        if (arg == "--checkpoint" && a + 1 < argc)
+            checkpoint = argv[++a];
+        else if (arg == "--resume")
+            resume = true;
+        else if (arg == "--output" && a + 1 < argc)
+            output = argv[++a];
+        else if (arg == "--plain")
+            plain = true;
+        else if (arg == "--stream" && a + 1 < argc)
+            stream = argv[++a];
+        else if (arg == "--scene" && a + 1 < argc)
+            scenes.push_back(argv[++a]);
+        else if (arg == "--batch" && a + 1 < argc && !SceneFile::ReadBatch(argv[++a], scenes))
+            return -1;
+    }
+    if (resume && checkpoint.empty())
+        checkpoint = "render.ckpt";
+    auto configure = [&](RayTracer &rayTracer, const std::string &scene, const std::string &sceneOutput) {
+        auto own = [&](const std::string &path) {
+            return scene.empty() || path.empty() ? path : SceneFile::PathFor(path, scene);
+        };
+        const std::string &given = output.empty() ? sceneOutput : output;
+        rayTracer.CheckpointPath = own(checkpoint);
+        rayTracer.Resume = resume;
+        rayTracer.OutputPath = given.empty() && !scene.empty() ? SceneFile::Name(scene) + ".ppm" : own(given);
+        rayTracer.StreamPath = own(stream);
+        if (!rayTracer.OutputPath.empty() && !plain)
+            rayTracer.OutputFormat = ImageFile::FromPath(rayTracer.OutputPath);
+    };
+
+    // Scenes share the meshes they name, read once. --output takes the place of the output line
+    // of a scene file
+    if (!scenes.empty()) {
+        const bool several = scenes.size() > 1;
+        for (size_t i = 0; several && i < scenes.size(); ++i)
+            for (size_t j = 0; j < i; ++j)
+                if (SceneFile::Name(scenes[i]) == SceneFile::Name(scenes[j])) {
+                    std::cerr << scenes[j] << " and " << scenes[i] << " would share files, rename one" << std::endl;
+                    return -1;
+                }
+
+        MeshCache meshes;
+        std::set<std::string> written;
+        int failed = 0;
+        for (const auto &path : scenes) {
+            SceneFile scene(path, meshes);
+            if (!scene.IsSuccess()) { ++failed; continue; }
+            RayTracer rayTracer(scene.World(), scene.GetCamera(), scene.GetImage());
+            configure(rayTracer, several ? path : "", scene.Output());
+            scene.Configure(rayTracer);
+
+            // Output lines can still name the same files from different scenes
+            bool clash = false;
+            for (const auto *file : {&rayTracer.OutputPath, &rayTracer.CheckpointPath, &rayTracer.StreamPath})
+                clash = (!file->empty() && !written.insert(*file).second) || clash;
+            if (clash) {
+                std::cerr << "Not rendering " << path << ", its files are an earlier scene's" << std::endl;
+                ++failed;
+                continue;
+            }
+            std::cerr << "Rendering " << path << std::endl;
+            if (rayTracer.Exec() != 0) ++failed;
+        }
+        return failed == 0 ? 0 : 1;
+    }
+
+    ObjectList world;
+
+    // Read file, its materials into the world's table
+    ObjReader obj("../models/cornellBox.obj", &world.materials);
     if (!obj.IsSuccess()) { std::cerr << "failed" << std::endl; return -1; }
 
     // std::vector<Triangle> tri = obj.GetTris();
     std::vector<std::shared_ptr<Triangle>> tri = obj.GetTris();
 
-    ObjectList world;
     // world.add(std::make_shared<Sphere>(Point3(-1,0,0), 0.5)); // left sphere
     // world.add(std::make_shared<Sphere>(Point3(0,0,-1), 0.5)); // middle sphere
     // world.add(std::make_shared<Sphere>(Point3(1,0,0), 0.5)); // right sphere
@@ -48,21 +135,28 @@ int main (const int argc, const char *argv[]) {
     world.add(std::make_shared<Sphere>(Point3(1,-0.5,0), 0.5)); // sphere
 
     // Materials
+    Material red;
+    red.Ambient = Colour3(0.5f, 0.0f, 0.0f);
+    red.Diffuse = Colour3(1.0f, 0.0f, 0.0f);
+
+    Material green;
+    green.Ambient = Colour3(0.0f, 0.5f, 0.0f);
+    green.Diffuse = Colour3(0.0f, 1.0f, 0.0f);
+
+    Material mirror;
+    mirror.Impulse = 1.1f;
+    mirror.ImpulseAlbedo = 1.0f;
+
     // Left wall
-    world.objects[1]->Ambient = Colour3(0.5f, 0.0f, 0.0f);
-    world.objects[1]->Diffuse = Colour3(1.0f, 0.0f, 0.0f);
+    world.objects[1]->MaterialId = world.materials.Add(red, "red");
 
     // Right wall
-    world.objects[2]->Ambient = Colour3(0.0f, 0.5f, 0.0f);
-    world.objects[2]->Diffuse = Colour3(0.0f, 1.0f, 0.0f);
-
-    // Bottom wall
-    world.objects[3]->Impulse = 1.1f;
-    world.objects[3]->ImpulseAlbedo = 1.0f;
+    world.objects[2]->MaterialId = world.materials.Add(green, "green");
 
-    // Left Sphere
-    world.objects[5]->Impulse = 1.1f;
-    world.objects[5]->ImpulseAlbedo = 1.0f;
+    // Bottom wall and left sphere
+    uint16_t mirrorId = world.materials.Add(mirror, "mirror");
+    world.objects[3]->MaterialId = mirrorId;
+    world.objects[5]->MaterialId = mirrorId;
 
     // // Left sphere
     // world.objects[0]->Ambient = Colour3(0.5f, 0.0f, 0.0f);
@@ -93,5 +187,6 @@ int main (const int argc, const char *argv[]) {
     Camera cam; /// Default camera
 
     RayTracer rayTracer(world, cam, img);
+    configure(rayTracer, "", "");
     return rayTracer.Exec();
 }
\ No newline at end of file